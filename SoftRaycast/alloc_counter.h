@@ -0,0 +1,158 @@
+#pragma once
+#include <new>
+#include <atomic>
+#include <cstdlib>
+#include <cstdio>
+
+// Routes the global operator new through counters, tagged with the subsystem
+// of the innermost ALLOC_SCOPE on the allocating thread. On in debug builds,
+// where render_scene asserts that tracing a frame never touches the heap;
+// building with COUNT_ALLOCATIONS=1 tracks a release build too.
+#ifndef COUNT_ALLOCATIONS
+#ifdef _DEBUG
+#define COUNT_ALLOCATIONS 1
+#else
+#define COUNT_ALLOCATIONS 0
+#endif
+#endif
+
+enum alloc_tag
+{
+	ALLOC_OTHER,
+	// Tiles and frame setup in render_scene
+	ALLOC_TRACE,
+	// Light and shadow work under the trace
+	ALLOC_LIGHTING,
+	ALLOC_SCENE_BUILD,
+	// Images, statistics and logs written after a frame
+	ALLOC_OUTPUT,
+	ALLOC_SDL,
+	ALLOC_TAG_COUNT
+};
+
+const char* alloc_tag_name(int tag)
+{
+	static const char* names[ALLOC_TAG_COUNT] = { "other", "trace", "lighting", "scene build", "output", "SDL" };
+	return names[tag];
+}
+
+struct alloc_counts
+{
+	unsigned long long count[ALLOC_TAG_COUNT];
+	unsigned long long bytes[ALLOC_TAG_COUNT];
+
+	unsigned long long total() const
+	{
+		unsigned long long sum = 0;
+		for (int i = 0; i < ALLOC_TAG_COUNT; i++)
+			sum += count[i];
+		return sum;
+	}
+
+	alloc_counts operator-(const alloc_counts& earlier) const
+	{
+		alloc_counts d;
+		for (int i = 0; i < ALLOC_TAG_COUNT; i++)
+		{
+			d.count[i] = count[i] - earlier.count[i];
+			d.bytes[i] = bytes[i] - earlier.bytes[i];
+		}
+		return d;
+	}
+};
+
+#if COUNT_ALLOCATIONS
+
+thread_local unsigned long long thread_allocations = 0;
+thread_local int thread_alloc_tag = ALLOC_OTHER;
+std::atomic<unsigned long long> tagged_allocations[ALLOC_TAG_COUNT];
+std::atomic<unsigned long long> tagged_bytes[ALLOC_TAG_COUNT];
+
+void* counted_alloc(size_t size)
+{
+	thread_allocations++;
+	tagged_allocations[thread_alloc_tag].fetch_add(1, std::memory_order_relaxed);
+	tagged_bytes[thread_alloc_tag].fetch_add(size, std::memory_order_relaxed);
+	void* p = malloc(size ? size : 1);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new(size_t size) { return counted_alloc(size); }
+void* operator new[](size_t size) { return counted_alloc(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+// Tags what the calling thread allocates until the end of the scope
+struct alloc_scope
+{
+	int previous;
+
+	alloc_scope(int tag) : previous(thread_alloc_tag)
+	{
+		thread_alloc_tag = tag;
+	}
+
+	~alloc_scope()
+	{
+		thread_alloc_tag = previous;
+	}
+
+	alloc_scope(const alloc_scope&) = delete;
+	alloc_scope& operator=(const alloc_scope&) = delete;
+};
+
+#define ALLOC_CONCAT_INNER(a, b) a##b
+#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_INNER(a, b)
+#define ALLOC_SCOPE(tag) alloc_scope ALLOC_CONCAT(alloc_scope_, __LINE__)(tag)
+
+#else
+#define ALLOC_SCOPE(tag) ((void) 0)
+#endif
+
+// Allocations made so far by the calling thread (always 0 when not counting)
+unsigned long long allocation_count()
+{
+#if COUNT_ALLOCATIONS
+	return thread_allocations;
+#else
+	return 0;
+#endif
+}
+
+// Allocations made so far by every thread, per tag; subtract two snapshots
+// for the allocations in between
+alloc_counts alloc_snapshot()
+{
+	alloc_counts counts = {};
+#if COUNT_ALLOCATIONS
+	for (int i = 0; i < ALLOC_TAG_COUNT; i++)
+	{
+		counts.count[i] = tagged_allocations[i].load(std::memory_order_relaxed);
+		counts.bytes[i] = tagged_bytes[i].load(std::memory_order_relaxed);
+	}
+#endif
+	return counts;
+}
+
+// Allocations the render path made in a frame, which must be none once the
+// first frame has sized every buffer
+unsigned long long render_allocations(const alloc_counts& frame)
+{
+	return frame.count[ALLOC_TRACE] + frame.count[ALLOC_LIGHTING];
+}
+
+void print_alloc_counts(const alloc_counts& counts)
+{
+	const char* separator = "";
+	for (int i = 0; i < ALLOC_TAG_COUNT; i++)
+	{
+		printf("%s%s %llu", separator, alloc_tag_name(i), counts.count[i]);
+		if (counts.count[i] > 0)
+			printf(" (%llu B)", counts.bytes[i]);
+		separator = ", ";
+	}
+}
@@ -0,0 +1,245 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include "glm/vec3.hpp"
+#include "glm/common.hpp"
+#include "sphere.h"
+#include "alloc_counter.h"
+#include "job_system.h"
+
+// Binned SAH builder settings
+#define BVH_BINS 16
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 60
+// Subtrees bigger than this are built as a job of their own
+#define BVH_PARALLEL_MIN_SPHERES 1024
+
+struct aabb
+{
+	glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+
+	void grow(const glm::vec3& p)
+	{
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+
+	void grow(const aabb& b)
+	{
+		min = glm::min(min, b.min);
+		max = glm::max(max, b.max);
+	}
+
+	float area() const
+	{
+		glm::vec3 e = max - min;
+		if (e.x < 0)
+			return 0;
+		return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+};
+
+// 32 byte node. Interior nodes (count == 0) keep their two children next to
+// each other at first and first + 1. Leaves cover indices[first, first + count).
+struct bvh_node
+{
+	glm::vec3 bounds_min;
+	int first;
+	glm::vec3 bounds_max;
+	int count;
+};
+
+struct bvh
+{
+	std::vector<bvh_node> nodes;
+	std::vector<int> indices;
+
+	// Build report
+	int sphere_count = 0;
+	int node_count = 0;
+	int leaf_count = 0;
+	int depth = 0;
+	double build_ms = 0;
+
+	bool empty() const
+	{
+		return nodes.empty();
+	}
+};
+
+struct bvh_builder
+{
+	bvh& tree;
+	job_system& jobs;
+	std::vector<aabb> boxes;
+	std::vector<glm::vec3> centroids;
+	std::atomic<int> next_node{ 1 };
+
+	bvh_builder(bvh& tree, const std::vector<sphere>& spheres, job_system& jobs) : tree(tree), jobs(jobs)
+	{
+		int n = (int) spheres.size();
+		boxes.resize(n);
+		centroids.resize(n);
+
+		for (int i = 0; i < n; i++)
+		{
+			glm::vec3 r(spheres[i].radius);
+			boxes[i].min = spheres[i].center - r;
+			boxes[i].max = spheres[i].center + r;
+			centroids[i] = spheres[i].center;
+		}
+
+		tree.indices.resize(n);
+		for (int i = 0; i < n; i++)
+			tree.indices[i] = i;
+
+		tree.nodes.resize(glm::max(2 * n - 1, 1));
+	}
+
+	void make_leaf(bvh_node& node, int first, int count)
+	{
+		node.first = first;
+		node.count = count;
+	}
+
+	void build(int node_index, int first, int count, int depth)
+	{
+		bvh_node& node = tree.nodes[node_index];
+
+		aabb bounds, centroid_bounds;
+		for (int i = first; i < first + count; i++)
+		{
+			bounds.grow(boxes[tree.indices[i]]);
+			centroid_bounds.grow(centroids[tree.indices[i]]);
+		}
+		node.bounds_min = bounds.min;
+		node.bounds_max = bounds.max;
+
+		if (count <= BVH_MAX_LEAF_SIZE || depth >= BVH_MAX_DEPTH)
+			return make_leaf(node, first, count);
+
+		glm::vec3 extent = centroid_bounds.max - centroid_bounds.min;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		if (extent[axis] <= 0)
+			return make_leaf(node, first, count);
+
+		// Bin the centroids along the widest axis
+		aabb bin_bounds[BVH_BINS];
+		int bin_count[BVH_BINS] = {};
+		float scale = BVH_BINS / extent[axis];
+
+		auto bin_of = [&](int sphere_index)
+		{
+			int b = (int) ((centroids[sphere_index][axis] - centroid_bounds.min[axis]) * scale);
+			return glm::clamp(b, 0, BVH_BINS - 1);
+		};
+
+		for (int i = first; i < first + count; i++)
+		{
+			int b = bin_of(tree.indices[i]);
+			bin_count[b]++;
+			bin_bounds[b].grow(boxes[tree.indices[i]]);
+		}
+
+		// Sweep from both sides to evaluate every split plane between bins
+		float left_area[BVH_BINS - 1];
+		int left_count[BVH_BINS - 1];
+		aabb left_box;
+		int left_total = 0;
+		for (int b = 0; b < BVH_BINS - 1; b++)
+		{
+			left_box.grow(bin_bounds[b]);
+			left_total += bin_count[b];
+			left_area[b] = left_box.area();
+			left_count[b] = left_total;
+		}
+
+		float best_cost = std::numeric_limits<float>::max();
+		int best_split = -1;
+		aabb right_box;
+		int right_total = 0;
+		for (int b = BVH_BINS - 1; b > 0; b--)
+		{
+			right_box.grow(bin_bounds[b]);
+			right_total += bin_count[b];
+
+			if (left_count[b - 1] == 0 || right_total == 0)
+				continue;
+
+			float cost = left_count[b - 1] * left_area[b - 1] + right_total * right_box.area();
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_split = b;
+			}
+		}
+
+		if (best_split < 0 || best_cost >= count * bounds.area())
+			return make_leaf(node, first, count);
+
+		int* begin = tree.indices.data() + first;
+		int* middle = std::partition(begin, begin + count, [&](int i) { return bin_of(i) < best_split; });
+		int left = (int) (middle - begin);
+
+		int child = next_node.fetch_add(2);
+		node.first = child;
+		node.count = 0;
+
+		if (count >= BVH_PARALLEL_MIN_SPHERES)
+		{
+			job_counter left_built;
+			auto build_left = [&]
+			{
+				ALLOC_SCOPE(ALLOC_SCENE_BUILD);
+				build(child, first, left, depth + 1);
+			};
+			jobs.spawn(left_built, build_left);
+			build(child + 1, first + left, count - left, depth + 1);
+			jobs.wait(left_built);
+		}
+		else
+		{
+			build(child, first, left, depth + 1);
+			build(child + 1, first + left, count - left, depth + 1);
+		}
+	}
+};
+
+void bvh_collect_stats(bvh& tree, int node_index, int depth)
+{
+	const bvh_node& node = tree.nodes[node_index];
+	tree.node_count++;
+	tree.depth = glm::max(tree.depth, depth);
+
+	if (node.count > 0)
+	{
+		tree.leaf_count++;
+		return;
+	}
+
+	bvh_collect_stats(tree, node.first, depth + 1);
+	bvh_collect_stats(tree, node.first + 1, depth + 1);
+}
+
+void build_bvh(bvh& tree, const std::vector<sphere>& spheres, job_system& jobs)
+{
+	auto begin = std::chrono::steady_clock::now();
+
+	tree = bvh();
+	tree.sphere_count = (int) spheres.size();
+	if (spheres.empty())
+		return;
+
+	bvh_builder builder(tree, spheres, jobs);
+	builder.build(0, 0, (int) spheres.size(), 0);
+	tree.nodes.resize(builder.next_node);
+
+	bvh_collect_stats(tree, 0, 0);
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+	tree.build_ms = elapsed.count();
+}
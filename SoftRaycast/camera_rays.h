@@ -0,0 +1,73 @@
+#pragma once
+#include <vector>
+#include <limits>
+#include "glm/vec3.hpp"
+#include "glm/mat4x4.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "camera.h"
+#include "ray.h"
+
+// Primary rays of a frame. A pixel's viewport point v has v.x set by its
+// column, v.y by its row and v.z = distance, so R * v splits into
+// (R[0] * v.x + R[1] * v.y) + (R[2] * v.z + R[3]), the same products and
+// sums as the mat4 * vec4 it replaces. The per-column and per-row terms are
+// cached and only rebuilt when the orientation, resolution or viewport
+// changes, which leaves two adds and a subtract per pixel.
+struct camera_ray_generator
+{
+	int width = 0;
+	int height = 0;
+	glm::vec3 viewport_scale = glm::vec3(0);
+	glm::vec3 orientation = glm::vec3(0);
+	bool valid = false;
+
+	std::vector<glm::vec3> column_terms;
+	std::vector<glm::vec3> row_terms;
+	glm::vec3 depth_term = glm::vec3(0);
+	glm::vec3 origin = glm::vec3(0);
+
+	// scale maps canvas units to the viewport on x and y, scale.z is the
+	// viewport distance
+	void prepare(const camera& c, int canvas_width, int canvas_height, const glm::vec3& scale)
+	{
+		origin = c.origin;
+
+		if (valid && width == canvas_width && height == canvas_height && viewport_scale == scale && orientation == c.orientation)
+			return;
+
+		width = canvas_width;
+		height = canvas_height;
+		viewport_scale = scale;
+		orientation = c.orientation;
+		valid = true;
+
+		glm::quat q{ orientation };
+		glm::mat4 rotation = glm::mat4_cast(q);
+
+		column_terms.resize(width);
+		for (int sx = 0; sx < width; sx++)
+		{
+			float cx = (float) (sx - width / 2);
+			column_terms[sx] = glm::vec3(rotation[0] * (cx * scale.x));
+		}
+
+		row_terms.resize(height);
+		for (int sy = 0; sy < height; sy++)
+		{
+			float cy = (float) (height / 2 - sy - 1);
+			row_terms[sy] = glm::vec3(rotation[1] * (cy * scale.y));
+		}
+
+		depth_term = glm::vec3(rotation[2] * scale.z + rotation[3]);
+	}
+
+	ray get_ray(int sx, int sy) const
+	{
+		ray r;
+		r.origin = origin;
+		r.direction = ((column_terms[sx] + row_terms[sy]) + depth_term) - origin;
+		r.t_min = 1;
+		r.t_max = std::numeric_limits<float>::infinity();
+		return r;
+	}
+};
@@ -0,0 +1,139 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include "glm/vec3.hpp"
+#include "glm/common.hpp"
+#include "framebuffer.h"
+#include "render_stats.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define HEATMAP_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HEATMAP_RDTSC 1
+#else
+#define HEATMAP_RDTSC 0
+#endif
+
+// What a pixel's cost is measured in
+enum heatmap_metric
+{
+	HEATMAP_OFF,
+	// Time stamp counter ticks, or nanoseconds where there is none
+	HEATMAP_CYCLES,
+	// Primary, shadow and reflection rays (needs RENDER_STATS)
+	HEATMAP_RAYS,
+	// Sphere and plane intersection tests (needs RENDER_STATS)
+	HEATMAP_TESTS
+};
+
+const char* heatmap_metric_name(int metric)
+{
+	static const char* names[] = { "off", "cycles", "rays", "tests" };
+	return names[metric];
+}
+
+unsigned long long read_cycle_counter()
+{
+#if HEATMAP_RDTSC
+	return __rdtsc();
+#else
+	return (unsigned long long) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Running total of metric on the calling thread; a pixel costs the
+// difference between the values taken before and after tracing it
+unsigned long long heatmap_sample(int metric)
+{
+	if (metric == HEATMAP_CYCLES)
+		return read_cycle_counter();
+
+#if RENDER_STATS
+	const render_stats& s = local_render_stats();
+	if (metric == HEATMAP_RAYS)
+		return s.ray_total();
+	if (metric == HEATMAP_TESTS)
+		return s.sphere_tests + s.plane_tests;
+#endif
+	return 0;
+}
+
+// Work spent on each pixel of the last frame, row-major
+struct cost_heatmap
+{
+	int metric = HEATMAP_OFF;
+	int width = 0;
+	int height = 0;
+	std::vector<float> cost;
+
+	void resize(int w, int h)
+	{
+		width = w;
+		height = h;
+		cost.assign((size_t) w * h, 0);
+	}
+
+	void set(int x, int y, unsigned long long value)
+	{
+		cost[(size_t) y * width + x] = (float) value;
+	}
+};
+
+// Dark blue through red to white, t in [0, 1]
+glm::vec3 heatmap_color(float t)
+{
+	static const glm::vec3 stops[] =
+	{
+		{ 0, 0, 32 }, { 48, 18, 160 }, { 200, 30, 120 }, { 250, 120, 20 }, { 255, 230, 80 }, { 255, 255, 255 }
+	};
+	const int last = (int) (sizeof(stops) / sizeof(stops[0])) - 1;
+
+	float x = glm::clamp(t, 0.0f, 1.0f) * last;
+	int i = glm::min((int) x, last - 1);
+	return glm::mix(stops[i], stops[i + 1], x - i);
+}
+
+// Paints the heatmap into image, scaled so the 99th percentile cost is the
+// top of the ramp; the few pixels above it saturate instead of washing out
+// everything else. Returns that scale.
+float heatmap_to_framebuffer(const cost_heatmap& heatmap, framebuffer& image)
+{
+	std::vector<float> sorted = heatmap.cost;
+	float scale = 0;
+	if (!sorted.empty())
+	{
+		size_t p99 = (sorted.size() - 1) * 99 / 100;
+		std::nth_element(sorted.begin(), sorted.begin() + p99, sorted.end());
+		scale = sorted[p99];
+	}
+	if (scale <= 0)
+		scale = 1;
+
+	image.resize(heatmap.width, heatmap.height);
+	for (int y = 0; y < heatmap.height; y++)
+		for (int x = 0; x < heatmap.width; x++)
+			image.set_pixel(x, y, heatmap_color(heatmap.cost[(size_t) y * heatmap.width + x] / scale));
+
+	for (int task = 0; task < image.linearize_tasks(); task++)
+		image.linearize(task);
+
+	return scale;
+}
+
+void print_heatmap_summary(const cost_heatmap& heatmap, float scale)
+{
+	double total = 0;
+	float highest = 0;
+	for (float c : heatmap.cost)
+	{
+		total += c;
+		highest = glm::max(highest, c);
+	}
+
+	double mean = heatmap.cost.empty() ? 0 : total / heatmap.cost.size();
+	printf("  %s per pixel: mean %.1f, 99th percentile %.1f, max %.1f\n", heatmap_metric_name(heatmap.metric), mean, scale, highest);
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "glm/common.hpp"
+
+// Frame time histogram in the style of HdrHistogram: microsecond values are
+// counted exactly below 2 * LATENCY_HALF_BUCKETS, and above that every power
+// of two is split into LATENCY_HALF_BUCKETS linear buckets, so any value is
+// off by less than 1 / LATENCY_HALF_BUCKETS (under 1.6%) at any magnitude.
+#define LATENCY_SUB_BITS 7
+#define LATENCY_HALF_BUCKETS (1 << (LATENCY_SUB_BITS - 1))
+// Powers of two above the exact range, up to about 2^37 us
+#define LATENCY_MAGNITUDES 31
+#define LATENCY_BUCKETS ((LATENCY_MAGNITUDES + 2) * LATENCY_HALF_BUCKETS)
+
+int highest_bit(unsigned long long value)
+{
+	int bit = 0;
+	while (value >>= 1)
+		bit++;
+	return bit;
+}
+
+struct latency_histogram
+{
+	unsigned long long counts[LATENCY_BUCKETS];
+	unsigned long long count;
+	unsigned long long max_us;
+
+	void clear()
+	{
+		memset(counts, 0, sizeof(counts));
+		count = 0;
+		max_us = 0;
+	}
+
+	static int bucket(unsigned long long us)
+	{
+		if (us < 2 * LATENCY_HALF_BUCKETS)
+			return (int) us;
+
+		int magnitude = glm::min(highest_bit(us) - LATENCY_SUB_BITS + 1, LATENCY_MAGNITUDES);
+		int sub = (int) glm::min(us >> magnitude, (unsigned long long) 2 * LATENCY_HALF_BUCKETS - 1);
+		return magnitude * LATENCY_HALF_BUCKETS + sub;
+	}
+
+	// Largest value that lands in bucket index
+	static unsigned long long bucket_top(int index)
+	{
+		if (index < 2 * LATENCY_HALF_BUCKETS)
+			return index;
+
+		int magnitude = index / LATENCY_HALF_BUCKETS - 1;
+		unsigned long long sub = index - magnitude * LATENCY_HALF_BUCKETS;
+		return ((sub + 1) << magnitude) - 1;
+	}
+
+	void record(double ms)
+	{
+		unsigned long long us = (unsigned long long) glm::max(ms * 1000, 0.0);
+		counts[bucket(us)]++;
+		count++;
+		max_us = glm::max(max_us, us);
+	}
+
+	// Value in ms that fraction of the records are at or below, rounded up to
+	// the top of its bucket
+	double percentile(double fraction) const
+	{
+		if (count == 0)
+			return 0;
+
+		unsigned long long rank = (unsigned long long) glm::ceil(fraction * count);
+		rank = glm::clamp(rank, 1ull, count);
+
+		unsigned long long seen = 0;
+		for (int i = 0; i < LATENCY_BUCKETS; i++)
+		{
+			seen += counts[i];
+			if (seen >= rank)
+				return glm::min(bucket_top(i), max_us) / 1000.0;
+		}
+		return max_us / 1000.0;
+	}
+};
+
+// Stages of a frame. Frame setup prepares the camera rays and the traversal
+// order; the rays themselves are generated inside the tile pass. Trace and
+// shade share that pass and are not timed on their own: render_scene splits
+// its wall time by the thread time the wavefront spent in the intersection
+// kernels (primary, reflection and shadow rays) and in everything else, so
+// both are estimates. Builds without WAVEFRONT_RENDER count it all as trace.
+enum frame_stage
+{
+	STAGE_FRAME_SETUP,
+	STAGE_TRACE,
+	STAGE_SHADE,
+	STAGE_LINEARIZE,
+	STAGE_PRESENT,
+	STAGE_COUNT
+};
+
+const char* frame_stage_name(int stage)
+{
+	static const char* names[STAGE_COUNT] = { "frame setup", "trace (est)", "shade (est)", "linearize", "present" };
+	return names[stage];
+}
+
+struct frame_stage_times
+{
+	double ms[STAGE_COUNT];
+};
+
+// Thread time of the wavefront stages of the current frame, summed over
+// threads. Only gathered while stage_timing is set.
+bool stage_timing = false;
+std::atomic<long long> wavefront_trace_ns{ 0 };
+std::atomic<long long> wavefront_shade_ns{ 0 };
+
+long long stage_clock_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Frame and stage times of a session
+struct frame_recorder
+{
+	latency_histogram total;
+	latency_histogram stages[STAGE_COUNT];
+
+	frame_recorder()
+	{
+		total.clear();
+		for (latency_histogram& h : stages)
+			h.clear();
+	}
+
+	void record(double total_ms, const frame_stage_times& times)
+	{
+		total.record(total_ms);
+		for (int s = 0; s < STAGE_COUNT; s++)
+			stages[s].record(times.ms[s]);
+	}
+
+	void print_report() const
+	{
+		if (total.count == 0)
+			return;
+
+		printf("Frame times over %llu frames:\n", total.count);
+		printf("  %-14s %8s %8s %8s %8s\n", "", "p50 ms", "p95 ms", "p99 ms", "max ms");
+		printf("  %-14s %8.2f %8.2f %8.2f %8.2f\n", "frame", total.percentile(0.5), total.percentile(0.95),
+			total.percentile(0.99), total.max_us / 1000.0);
+		for (int s = 0; s < STAGE_COUNT; s++)
+		{
+			const latency_histogram& h = stages[s];
+			printf("  %-14s %8.2f %8.2f %8.2f %8.2f\n", frame_stage_name(s), h.percentile(0.5), h.percentile(0.95),
+				h.percentile(0.99), h.max_us / 1000.0);
+		}
+		printf("  Trace and shade split the tile pass by wavefront thread time\n");
+	}
+};
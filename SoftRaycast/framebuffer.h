@@ -0,0 +1,109 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <SDL.h>
+#include "glm/vec3.hpp"
+#include "glm/common.hpp"
+
+// Store the traced pixels as FRAMEBUFFER_TILE_SIZE square tiles, each one
+// contiguous, so a render tile writes a few cache lines instead of touching
+// one row per pixel. linearize() turns them into rows for output.
+#define FRAMEBUFFER_TILED 1
+// Must be a power of two
+#define FRAMEBUFFER_TILE_SIZE 32
+
+static_assert((FRAMEBUFFER_TILE_SIZE & (FRAMEBUFFER_TILE_SIZE - 1)) == 0, "framebuffer tiles are a power of two");
+
+// Packs a [0, 255] float color into an opaque ARGB8888 pixel
+Uint32 pack_argb8888(const glm::vec3& color)
+{
+	Uint32 r = (Uint32) glm::clamp(color.x, 0.0f, 255.0f);
+	Uint32 g = (Uint32) glm::clamp(color.y, 0.0f, 255.0f);
+	Uint32 b = (Uint32) glm::clamp(color.z, 0.0f, 255.0f);
+	return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+// CPU side image the tracer writes into. pixels is packed ARGB8888,
+// row-major with no padding, so it can be handed to SDL as is. With
+// FRAMEBUFFER_TILED, set_pixel writes to tiles instead and pixels is only
+// valid after linearize().
+struct framebuffer
+{
+	int width = 0;
+	int height = 0;
+	std::vector<Uint32> pixels;
+
+#if FRAMEBUFFER_TILED
+	int tiles_x = 0;
+	int tiles_y = 0;
+	std::vector<Uint32> tiles;
+#endif
+
+	void resize(int w, int h)
+	{
+		width = w;
+		height = h;
+		pixels.assign((size_t) w * h, 0xff000000);
+
+#if FRAMEBUFFER_TILED
+		tiles_x = (w + FRAMEBUFFER_TILE_SIZE - 1) / FRAMEBUFFER_TILE_SIZE;
+		tiles_y = (h + FRAMEBUFFER_TILE_SIZE - 1) / FRAMEBUFFER_TILE_SIZE;
+		tiles.assign((size_t) tiles_x * tiles_y * FRAMEBUFFER_TILE_SIZE * FRAMEBUFFER_TILE_SIZE, 0xff000000);
+#endif
+	}
+
+	void clear(Uint32 argb)
+	{
+		std::fill(pixels.begin(), pixels.end(), argb);
+#if FRAMEBUFFER_TILED
+		std::fill(tiles.begin(), tiles.end(), argb);
+#endif
+	}
+
+	void set_pixel(int x, int y, const glm::vec3& color)
+	{
+#if FRAMEBUFFER_TILED
+		size_t tile = (size_t) (y / FRAMEBUFFER_TILE_SIZE) * tiles_x + x / FRAMEBUFFER_TILE_SIZE;
+		size_t offset = (y & (FRAMEBUFFER_TILE_SIZE - 1)) * FRAMEBUFFER_TILE_SIZE + (x & (FRAMEBUFFER_TILE_SIZE - 1));
+		tiles[tile * FRAMEBUFFER_TILE_SIZE * FRAMEBUFFER_TILE_SIZE + offset] = pack_argb8888(color);
+#else
+		pixels[(size_t) y * width + x] = pack_argb8888(color);
+#endif
+	}
+
+	// Rows of linearize() work, to spread it over threads
+	int linearize_tasks() const
+	{
+#if FRAMEBUFFER_TILED
+		return tiles_y;
+#else
+		return 0;
+#endif
+	}
+
+	// Copies tile row task of the tiled storage into pixels
+	void linearize(int task)
+	{
+#if FRAMEBUFFER_TILED
+		const int tile_pixels = FRAMEBUFFER_TILE_SIZE * FRAMEBUFFER_TILE_SIZE;
+		int y0 = task * FRAMEBUFFER_TILE_SIZE;
+		int y1 = glm::min(y0 + FRAMEBUFFER_TILE_SIZE, height);
+
+		for (int tx = 0; tx < tiles_x; tx++)
+		{
+			const Uint32* tile = tiles.data() + ((size_t) task * tiles_x + tx) * tile_pixels;
+			int x0 = tx * FRAMEBUFFER_TILE_SIZE;
+			int run = glm::min(FRAMEBUFFER_TILE_SIZE, width - x0);
+
+			for (int y = y0; y < y1; y++)
+				memcpy(&pixels[(size_t) y * width + x0], tile + (y - y0) * FRAMEBUFFER_TILE_SIZE, run * sizeof(Uint32));
+		}
+#endif
+	}
+
+	int pitch() const
+	{
+		return width * (int) sizeof(Uint32);
+	}
+};
@@ -3,6 +3,16 @@
 #include "sphere.h"
 #include "plane.h"
 #include "light.h"
+#include "sphere_soa.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "alloc_counter.h"
+#include "job_system.h"
+
+// Below this many spheres a linear SIMD scan beats walking a BVH
+#define BVH_MIN_SPHERES 64
+// Collapse the binary BVH into WIDE_BVH_WIDTH-ary nodes and trace that instead
+#define USE_WIDE_BVH 1
 
 
 struct geometry_scene
@@ -10,4 +20,63 @@ struct geometry_scene
 	std::vector<sphere> spheres;
 	std::vector<plane> planes;
 	std::vector<light> lights;
-};
\ No newline at end of file
+
+	// Derived data, rebuilt by prepare_scene
+	sphere_soa sphere_geometry;
+	// Terms shared by every primary ray, rebuilt each frame by prepare_primary_rays
+	sphere_origin_soa primary_spheres;
+	bvh sphere_bvh;
+	wide_bvh sphere_wide_bvh;
+
+	bool uses_bvh() const
+	{
+		return !sphere_bvh.empty() && sphere_bvh.sphere_count == (int) spheres.size();
+	}
+};
+
+// Refreshes the derived acceleration data. Call after editing the scene.
+// The BVH, followed by its wide collapse, builds while the calling thread
+// fills the SoA copy.
+void prepare_scene(geometry_scene& scene, job_system& jobs)
+{
+	ALLOC_SCOPE(ALLOC_SCENE_BUILD);
+	scene.sphere_bvh = bvh();
+	scene.sphere_wide_bvh = wide_bvh();
+
+	job_counter bvh_built;
+	job_counter done;
+	auto build_binary = [&]
+	{
+		ALLOC_SCOPE(ALLOC_SCENE_BUILD);
+		build_bvh(scene.sphere_bvh, scene.spheres, jobs);
+	};
+	auto build_wide = [&]
+	{
+		ALLOC_SCOPE(ALLOC_SCENE_BUILD);
+		build_wide_bvh(scene.sphere_wide_bvh, scene.sphere_bvh);
+	};
+
+	if (scene.spheres.size() >= BVH_MIN_SPHERES)
+	{
+		if (USE_WIDE_BVH)
+			jobs.then(bvh_built, done, build_wide);
+		jobs.spawn(bvh_built, build_binary);
+	}
+
+	scene.sphere_geometry.build(scene.spheres);
+	scene.primary_spheres = sphere_origin_soa();
+
+	jobs.wait(bvh_built);
+	jobs.wait(done);
+}
+
+// Hoists the origin dependent sphere terms for rays starting at origin.
+// Call once per frame, before tracing, with the camera origin. Only the
+// linear kernels read them, and they stay valid until the camera moves or
+// prepare_scene rebuilds the spheres, so most frames skip the O(N) pass.
+void prepare_primary_rays(geometry_scene& scene, const glm::vec3& origin)
+{
+	if (scene.uses_bvh() || scene.primary_spheres.built_for(scene.sphere_geometry, origin))
+		return;
+	scene.primary_spheres.build(scene.sphere_geometry, origin);
+}
\ No newline at end of file
@@ -0,0 +1,148 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <SDL.h>
+#include "glm/common.hpp"
+#include "framebuffer.h"
+
+// Reads a BMP into image as ARGB8888 rows. Returns false if it cannot be read.
+bool load_bmp(const char* path, framebuffer& image)
+{
+	SDL_Surface* loaded = SDL_LoadBMP(path);
+	if (loaded == nullptr)
+		return false;
+
+	SDL_Surface* argb = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0);
+	SDL_FreeSurface(loaded);
+	if (argb == nullptr)
+		return false;
+
+	image.resize(argb->w, argb->h);
+	for (int y = 0; y < argb->h; y++)
+		memcpy(&image.pixels[(size_t) y * argb->w], (const Uint8*) argb->pixels + (size_t) y * argb->pitch, argb->w * sizeof(Uint32));
+
+	SDL_FreeSurface(argb);
+	return true;
+}
+
+struct image_comparison
+{
+	bool same_size;
+	// Largest difference of any channel of any pixel
+	int max_difference;
+	// Pixels with a channel further apart than the tolerance
+	long long bad_pixels;
+};
+
+// Compares the linear pixels of two images. diff gets the per-pixel
+// difference, amplified so small errors show, with pixels past the
+// tolerance in red.
+image_comparison compare_images(const framebuffer& image, const framebuffer& golden, int tolerance, framebuffer& diff)
+{
+	image_comparison result = { image.width == golden.width && image.height == golden.height, 0, 0 };
+	if (!result.same_size)
+		return result;
+
+	diff.resize(image.width, image.height);
+	for (size_t i = 0; i < image.pixels.size(); i++)
+	{
+		Uint32 a = image.pixels[i];
+		Uint32 b = golden.pixels[i];
+		int largest = 0;
+		for (int shift = 0; shift < 24; shift += 8)
+			largest = glm::max(largest, abs((int) ((a >> shift) & 0xff) - (int) ((b >> shift) & 0xff)));
+
+		result.max_difference = glm::max(result.max_difference, largest);
+		if (largest > tolerance)
+		{
+			result.bad_pixels++;
+			diff.pixels[i] = 0xffff0000;
+		}
+		else
+		{
+			Uint32 grey = (Uint32) glm::min(largest * 64, 255);
+			diff.pixels[i] = 0xff000000 | (grey << 16) | (grey << 8) | grey;
+		}
+	}
+
+	return result;
+}
+
+// The history is one JSON object per line, one line per run:
+// {"time":...,"threads":4,"width":480,"height":270,"build":"...","update_golden":false,"passed":...,
+//  "scenes":[{"name":"demo","ms":...,"rays_per_s":...,"output_passed":true,"passed":true},...]}
+// output_passed covers every check but throughput.
+void append_history(const std::string& path, const std::string& entry)
+{
+	std::ofstream file(path, std::ios::app);
+	if (!file)
+		printf("Cannot write '%s'\n", path.c_str());
+	else
+		file << entry << '\n';
+}
+
+// Fields of a history entry that make its throughput comparable with
+// another run. build names the compiler and the compile-time switches,
+// which move throughput as much as the thread count does.
+std::string history_run_key(int threads, int width, int height, const std::string& build)
+{
+	return "\"threads\":" + std::to_string(threads) + ",\"width\":" + std::to_string(width) + ",\"height\":" + std::to_string(height) +
+		",\"build\":\"" + build + "\",";
+}
+
+struct history_throughput
+{
+	int runs = 0;
+	// Median rays_per_s of the runs, 0 when there are none
+	double median = 0;
+	// (fastest - slowest) / median of the runs, how much throughput varies
+	// between runs that changed nothing
+	double spread = 0;
+};
+
+// Throughput baseline of scene over its last runs entries in the history
+// with the given history_run_key whose output passed. Slow runs count too,
+// or the baseline would drift towards the fastest ones. Runs that only
+// rewrote the golden images are skipped: they often follow a change.
+history_throughput history_baseline(const std::string& path, const std::string& scene, const std::string& run_key, int runs)
+{
+	std::ifstream file(path);
+	std::vector<double> values;
+	std::string line;
+	std::string key = "{\"name\":\"" + scene + "\",";
+
+	while (std::getline(file, line))
+	{
+		if (line.find(run_key) == std::string::npos || line.find("\"update_golden\":true") != std::string::npos)
+			continue;
+
+		size_t at = line.find(key);
+		if (at == std::string::npos)
+			continue;
+
+		size_t end = line.find('}', at);
+		std::string record = line.substr(at, end - at);
+		if (record.find("\"output_passed\":true") == std::string::npos)
+			continue;
+
+		size_t rate = record.find("\"rays_per_s\":");
+		if (rate != std::string::npos)
+			values.push_back(atof(record.c_str() + rate + 13));
+	}
+
+	history_throughput baseline;
+	if (values.empty())
+		return baseline;
+	if ((int) values.size() > runs)
+		values.erase(values.begin(), values.end() - runs);
+
+	std::sort(values.begin(), values.end());
+	baseline.runs = (int) values.size();
+	baseline.median = values[values.size() / 2];
+	baseline.spread = (values.back() - values.front()) / baseline.median;
+	return baseline;
+}
@@ -0,0 +1,238 @@
+#pragma once
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#define HW_COUNTERS 1
+#else
+// Counters come from perf_event_open, elsewhere everything here is a no-op
+#define HW_COUNTERS 0
+#endif
+
+enum hw_counter
+{
+	HW_CYCLES,
+	HW_INSTRUCTIONS,
+	HW_L1D_MISSES,
+	HW_LLC_MISSES,
+	HW_BRANCH_MISSES,
+	// Raw, model specific event set by hw_counters_enable, e.g. 0x28c7 for
+	// FP_ARITH_INST_RETIRED 128 and 256 bit packed single on recent Intel
+	HW_SIMD,
+	HW_COUNTER_COUNT
+};
+
+struct hw_counter_values
+{
+	unsigned long long value[HW_COUNTER_COUNT];
+};
+
+struct hw_counter_config
+{
+	bool enabled = false;
+	unsigned long long simd_event = 0;
+	// Counters every thread managed to open, as bits of hw_counter
+	std::atomic<unsigned> available{ (1u << HW_COUNTER_COUNT) - 1 };
+} hw_config;
+
+// Turns counting on for every thread that records from now on. simd_event
+// is a raw PERF_TYPE_RAW config, 0 to leave HW_SIMD out.
+void hw_counters_enable(unsigned long long simd_event)
+{
+	hw_config.enabled = true;
+	hw_config.simd_event = simd_event;
+}
+
+// Counter group of one thread, opened the first time the thread reads it
+// and closed when the thread exits. Only the calling thread is counted, in
+// user mode, which perf_event_paranoid allows up to level 2.
+struct hw_thread_counters
+{
+	bool opened = false;
+	int leader = -1;
+	// Position of each counter in the group read, -1 when it did not open
+	int slot[HW_COUNTER_COUNT];
+	int slots = 0;
+	// Descriptors of the group, leader first
+	int fds[HW_COUNTER_COUNT];
+	int fd_count = 0;
+
+	~hw_thread_counters()
+	{
+#if HW_COUNTERS
+		for (int i = fd_count - 1; i >= 0; i--)
+			close(fds[i]);
+#endif
+	}
+};
+
+thread_local hw_thread_counters hw_thread;
+
+#if HW_COUNTERS
+
+int hw_open_event(unsigned type, unsigned long long config, int group)
+{
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.disabled = group < 0 ? 1 : 0;
+	return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+void hw_open_thread(hw_thread_counters& t)
+{
+	t.opened = true;
+	for (int i = 0; i < HW_COUNTER_COUNT; i++)
+		t.slot[i] = -1;
+
+	const unsigned long long l1d_read_miss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	struct { unsigned type; unsigned long long config; } events[HW_COUNTER_COUNT] =
+	{
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HW_CACHE, l1d_read_miss },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+		{ PERF_TYPE_RAW, hw_config.simd_event }
+	};
+
+	t.leader = hw_open_event(events[HW_CYCLES].type, events[HW_CYCLES].config, -1);
+	if (t.leader < 0)
+	{
+		hw_config.available = 0;
+		return;
+	}
+	t.slot[HW_CYCLES] = t.slots++;
+	t.fds[t.fd_count++] = t.leader;
+
+	unsigned opened = 1u << HW_CYCLES;
+	for (int i = HW_CYCLES + 1; i < HW_COUNTER_COUNT; i++)
+	{
+		if (i == HW_SIMD && hw_config.simd_event == 0)
+			continue;
+		int fd = hw_open_event(events[i].type, events[i].config, t.leader);
+		if (fd < 0)
+			continue;
+		t.fds[t.fd_count++] = fd;
+		t.slot[i] = t.slots++;
+		opened |= 1u << i;
+	}
+	hw_config.available &= opened;
+
+	ioctl(t.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(t.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+#endif
+
+// Running counts of the calling thread. False when counting is off or the
+// counters could not be opened.
+bool hw_read(hw_counter_values& values)
+{
+#if HW_COUNTERS
+	if (!hw_config.enabled)
+		return false;
+
+	hw_thread_counters& t = hw_thread;
+	if (!t.opened)
+		hw_open_thread(t);
+	if (t.leader < 0)
+		return false;
+
+	unsigned long long buffer[1 + HW_COUNTER_COUNT];
+	if (read(t.leader, buffer, sizeof(buffer)) < (ssize_t) ((1 + t.slots) * sizeof(unsigned long long)))
+		return false;
+
+	for (int i = 0; i < HW_COUNTER_COUNT; i++)
+		values.value[i] = t.slot[i] >= 0 ? buffer[1 + t.slot[i]] : 0;
+	return true;
+#else
+	(void) values;
+	return false;
+#endif
+}
+
+bool hw_counters_active()
+{
+	hw_counter_values probe;
+	return hw_read(probe) && (hw_config.available & (1u << HW_CYCLES));
+}
+
+// Counts summed over every thread that worked on a phase
+struct hw_counter_totals
+{
+	std::atomic<unsigned long long> value[HW_COUNTER_COUNT];
+
+	void clear()
+	{
+		for (int i = 0; i < HW_COUNTER_COUNT; i++)
+			value[i] = 0;
+	}
+
+	hw_counter_values load() const
+	{
+		hw_counter_values v;
+		for (int i = 0; i < HW_COUNTER_COUNT; i++)
+			v.value[i] = value[i].load();
+		return v;
+	}
+};
+
+// Adds what the calling thread counted during its lifetime to totals
+struct hw_counter_zone
+{
+	hw_counter_totals* totals;
+	hw_counter_values begin;
+
+	hw_counter_zone(hw_counter_totals* zone_totals) : totals(zone_totals)
+	{
+		if (totals != nullptr && !hw_read(begin))
+			totals = nullptr;
+	}
+
+	~hw_counter_zone()
+	{
+		hw_counter_values end;
+		if (totals == nullptr || !hw_read(end))
+			return;
+		for (int i = 0; i < HW_COUNTER_COUNT; i++)
+			totals->value[i] += end.value[i] - begin.value[i];
+	}
+
+	hw_counter_zone(const hw_counter_zone&) = delete;
+	hw_counter_zone& operator=(const hw_counter_zone&) = delete;
+};
+
+// Counts of a run, per op when ops > 1: IPC, then cycles, instructions and
+// the miss counts, leaving out counters that did not open
+void print_hw_counters(const hw_counter_values& v, double ops)
+{
+	static const char* names[HW_COUNTER_COUNT] = { "cycles", "instr", "L1D miss", "LLC miss", "br miss", "simd" };
+	unsigned available = hw_config.available;
+	const char* separator = " ";
+
+	if ((available & (1u << HW_INSTRUCTIONS)) && v.value[HW_CYCLES] > 0)
+	{
+		printf(" IPC %.2f", (double) v.value[HW_INSTRUCTIONS] / v.value[HW_CYCLES]);
+		separator = ", ";
+	}
+
+	for (int i = 0; i < HW_COUNTER_COUNT; i++)
+	{
+		if (available & (1u << i))
+		{
+			printf("%s%s %.*f", separator, names[i], ops > 1 ? 2 : 0, v.value[i] / ops);
+			separator = ", ";
+		}
+	}
+}
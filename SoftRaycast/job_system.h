@@ -0,0 +1,315 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "glm/common.hpp"
+
+// Jobs a thread's queue holds; spawning past that runs the job right away
+#define JOB_QUEUE_CAPACITY 4096
+// parallel_for splits its range into about this many pieces per thread
+#define JOB_SPLITS_PER_THREAD 8
+
+struct job_counter;
+
+// A function of an index range and the data it works on. The data belongs
+// to whoever spawned the job and has to outlive the wait on its counter.
+struct job
+{
+	void (*function)(const void* data, int begin, int end);
+	const void* data;
+	int begin;
+	int end;
+	job_counter* counter;
+};
+
+// Jobs spawned against the counter that have not finished yet. A
+// continuation, set with job_system::then, is spawned once it drops to zero.
+struct job_counter
+{
+	std::atomic<int> pending{ 0 };
+	job continuation = {};
+
+	job_counter() = default;
+	job_counter(const job_counter&) = delete;
+	job_counter& operator=(const job_counter&) = delete;
+};
+
+// Fork-join job system shared by everything that runs in parallel: tiles,
+// linearizing, BVH builds, scene preparation and image encoding. Each thread
+// has its own queue. It runs its newest job first and, when its queue is
+// empty, steals the oldest job of another thread, which is usually the
+// largest piece left. The thread that waits on a counter runs jobs until
+// the counter is done, so nested fork-join neither blocks a thread nor
+// needs more threads than cores. With main_thread_jobs off, the constructing
+// thread only spawns and sleeps in wait, and every core is a worker.
+struct job_system
+{
+	job_system(int thread_count, bool main_participates = true) : main_thread_jobs(main_participates)
+	{
+		if (thread_count <= 0)
+			thread_count = (int) std::thread::hardware_concurrency();
+		if (thread_count <= 0)
+			thread_count = 1;
+
+		// Queue 0 belongs to the constructing thread and to any thread that
+		// is not a worker
+		int worker_count = main_thread_jobs ? thread_count - 1 : thread_count;
+		queue_count = worker_count + 1;
+		queues.reset(new job_queue[queue_count]);
+
+		for (int i = 1; i <= worker_count; i++)
+			workers.emplace_back([this, i] { worker_loop(i); });
+	}
+
+	~job_system()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			shutdown = true;
+		}
+		wake.notify_all();
+
+		for (std::thread& t : workers)
+			t.join();
+	}
+
+	job_system(const job_system&) = delete;
+	job_system& operator=(const job_system&) = delete;
+
+	// Threads that run jobs
+	int size() const
+	{
+		return (int) workers.size() + (main_thread_jobs ? 1 : 0);
+	}
+
+	// Runs task() on some thread, counted in counter. task is not copied.
+	template <typename Task>
+	void spawn(job_counter& counter, const Task& task)
+	{
+		submit({ call_task<Task>, &task, 0, 0, &counter });
+	}
+
+	// Spawns task, counted in next, once counter drops to zero. Call before
+	// spawning anything against counter.
+	template <typename Task>
+	void then(job_counter& counter, job_counter& next, const Task& task)
+	{
+		next.pending++;
+		counter.continuation = { call_task<Task>, &task, 0, 0, &next };
+	}
+
+	// Runs task(i) for every i in [0, count) and returns once all of them finished
+	template <typename Task>
+	void parallel_for(int count, const Task& task)
+	{
+		if (count <= 0)
+			return;
+
+		job_counter done;
+		range_task<Task> range = { this, &task, &done, glm::max(1, count / (size() * JOB_SPLITS_PER_THREAD)) };
+		submit({ call_range<Task>, &range, 0, count, &done });
+		wait(done);
+	}
+
+	// Returns once every job counted in counter finished
+	void wait(job_counter& counter)
+	{
+		if (!main_thread_jobs && job_thread_system != this)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			blocked_waiters++;
+			finished.wait(lock, [&] { return counter.pending == 0; });
+			blocked_waiters--;
+			return;
+		}
+
+		int self = queue_index();
+		while (counter.pending > 0)
+		{
+			job j;
+			if (find_job(self, j))
+				execute(j);
+			else
+				std::this_thread::yield();
+		}
+	}
+
+private:
+	// Ring of jobs. The owner pushes and pops at the back, thieves take from
+	// the front.
+	struct job_queue
+	{
+		std::mutex mutex;
+		std::vector<job> jobs = std::vector<job>(JOB_QUEUE_CAPACITY);
+		int front = 0;
+		int count = 0;
+
+		bool push(const job& j)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (count == JOB_QUEUE_CAPACITY)
+				return false;
+			jobs[(front + count++) % JOB_QUEUE_CAPACITY] = j;
+			return true;
+		}
+
+		bool pop(job& j)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (count == 0)
+				return false;
+			j = jobs[(front + --count) % JOB_QUEUE_CAPACITY];
+			return true;
+		}
+
+		bool steal(job& j)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (count == 0)
+				return false;
+			j = jobs[front];
+			front = (front + 1) % JOB_QUEUE_CAPACITY;
+			count--;
+			return true;
+		}
+	};
+
+	template <typename Task>
+	struct range_task
+	{
+		job_system* system;
+		const Task* task;
+		job_counter* counter;
+		int grain;
+	};
+
+	template <typename Task>
+	static void call_task(const void* data, int, int)
+	{
+		(*(const Task*) data)();
+	}
+
+	// Hands the back half of the range to other threads until it is down to
+	// the grain, then runs the front
+	template <typename Task>
+	static void call_range(const void* data, int begin, int end)
+	{
+		const range_task<Task>& range = *(const range_task<Task>*) data;
+		while (end - begin > range.grain)
+		{
+			int middle = begin + (end - begin) / 2;
+			range.system->submit({ call_range<Task>, data, middle, end, range.counter });
+			end = middle;
+		}
+
+		for (int i = begin; i < end; i++)
+			(*range.task)(i);
+	}
+
+	static thread_local const job_system* job_thread_system;
+	static thread_local int job_thread_queue;
+
+	int queue_index() const
+	{
+		return job_thread_system == this ? job_thread_queue : 0;
+	}
+
+	void submit(const job& j)
+	{
+		j.counter->pending++;
+		enqueue(j);
+	}
+
+	// Queues a job its counter already counts
+	void enqueue(const job& j)
+	{
+		if (!queues[queue_index()].push(j))
+		{
+			execute(j);
+			return;
+		}
+
+		queued++;
+		if (sleeping > 0)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			wake.notify_one();
+		}
+	}
+
+	// Own newest job first, then the oldest of the next queue that has one
+	bool find_job(int self, job& j)
+	{
+		bool found = queues[self].pop(j);
+		for (int i = 1; !found && i < queue_count; i++)
+			found = queues[(self + i) % queue_count].steal(j);
+
+		if (found)
+			queued--;
+		return found;
+	}
+
+	void execute(const job& j)
+	{
+		j.function(j.data, j.begin, j.end);
+
+		// The counter may be gone once it reaches zero, so the continuation
+		// is read first
+		job_counter* counter = j.counter;
+		job continuation = counter->continuation;
+		if (counter->pending.fetch_sub(1) != 1)
+			return;
+
+		if (continuation.function != nullptr)
+			enqueue(continuation);
+		if (blocked_waiters > 0)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			finished.notify_all();
+		}
+	}
+
+	void worker_loop(int index)
+	{
+		job_thread_system = this;
+		job_thread_queue = index;
+
+		while (true)
+		{
+			job j;
+			if (find_job(index, j))
+			{
+				execute(j);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+			sleeping++;
+			wake.wait(lock, [this] { return shutdown || queued > 0; });
+			sleeping--;
+			if (shutdown)
+				return;
+		}
+	}
+
+	bool main_thread_jobs;
+	int queue_count = 0;
+	std::unique_ptr<job_queue[]> queues;
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	// Workers sleep on wake while no job is queued
+	std::condition_variable wake;
+	// Threads outside the system sleep on finished in wait
+	std::condition_variable finished;
+	std::atomic<int> queued{ 0 };
+	std::atomic<int> sleeping{ 0 };
+	std::atomic<int> blocked_waiters{ 0 };
+	bool shutdown = false;
+};
+
+thread_local const job_system* job_system::job_thread_system = nullptr;
+thread_local int job_system::job_thread_queue = 0;
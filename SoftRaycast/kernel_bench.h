@@ -0,0 +1,272 @@
+#pragma once
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include "glm/vec3.hpp"
+#include "glm/geometric.hpp"
+#include "geometry_scene.h"
+#include "raytrace.h"
+#include "hw_counters.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+// Declared by hand: windows.h would clash with LightType's POINT
+extern "C" __declspec(dllimport) void* __stdcall GetCurrentThread();
+extern "C" __declspec(dllimport) unsigned long __stdcall GetCurrentProcessorNumber();
+extern "C" __declspec(dllimport) size_t __stdcall SetThreadAffinityMask(void* thread, size_t mask);
+#endif
+
+// Inputs per kernel, cycled through so every op sees a different one
+#define BENCH_INPUTS 1024
+// Timed samples per kernel and the two sided 95% t value for BENCH_SAMPLES - 1
+// degrees of freedom
+#define BENCH_SAMPLES 21
+#define BENCH_T95 2.086
+// Minimum length of a timed sample, and of the warm-up before calibrating
+#define BENCH_SAMPLE_MS 5.0
+#define BENCH_WARMUP_MS 50.0
+
+// Results land here so the compiler cannot drop the kernels
+volatile float bench_sink;
+
+struct bench_result
+{
+	double mean_ns;
+	double stddev_ns;
+	double ci95_ns;
+	double min_ns;
+	double median_ns;
+	// Hardware counts per op over the timed samples, when counting
+	bool has_hw;
+	hw_counter_values hw;
+	double hw_ops;
+};
+
+// Pins the calling thread to the CPU it is running on, so samples are not
+// spread over cores with different clocks and caches. Returns the CPU, or -1.
+int pin_to_current_cpu()
+{
+#if defined(__linux__)
+	int cpu = sched_getcpu();
+	if (cpu < 0)
+		return -1;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? cpu : -1;
+#elif defined(_WIN32)
+	int cpu = (int) GetCurrentProcessorNumber();
+	if (cpu >= (int) sizeof(size_t) * 8)
+		return -1;
+	return SetThreadAffinityMask(GetCurrentThread(), (size_t) 1 << cpu) != 0 ? cpu : -1;
+#else
+	return -1;
+#endif
+}
+
+double bench_elapsed_ns(std::chrono::steady_clock::time_point begin)
+{
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+}
+
+// Runs kernel(i) for i = 0, 1, ... : warms up, picks an op count that makes
+// a sample last at least BENCH_SAMPLE_MS, then times BENCH_SAMPLES samples
+template <typename Kernel>
+bench_result run_kernel_bench(Kernel kernel)
+{
+	float sink = 0;
+	long long ops = 1;
+
+	auto warmup_begin = std::chrono::steady_clock::now();
+	while (bench_elapsed_ns(warmup_begin) < BENCH_WARMUP_MS * 1e6)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		for (long long i = 0; i < ops; i++)
+			sink += kernel((int) (i & (BENCH_INPUTS - 1)));
+		if (bench_elapsed_ns(begin) < BENCH_SAMPLE_MS * 1e6)
+			ops *= 2;
+	}
+
+	bench_result result;
+	hw_counter_values hw_begin;
+	result.has_hw = hw_read(hw_begin);
+
+	double samples[BENCH_SAMPLES];
+	for (int s = 0; s < BENCH_SAMPLES; s++)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		for (long long i = 0; i < ops; i++)
+			sink += kernel((int) (i & (BENCH_INPUTS - 1)));
+		samples[s] = bench_elapsed_ns(begin) / ops;
+	}
+	bench_sink = sink;
+
+	hw_counter_values hw_end;
+	if (result.has_hw && hw_read(hw_end))
+	{
+		for (int i = 0; i < HW_COUNTER_COUNT; i++)
+			result.hw.value[i] = hw_end.value[i] - hw_begin.value[i];
+		result.hw_ops = (double) ops * BENCH_SAMPLES;
+	}
+	else
+	{
+		result.has_hw = false;
+	}
+
+	double sum = 0;
+	for (double t : samples)
+		sum += t;
+	result.mean_ns = sum / BENCH_SAMPLES;
+
+	double squares = 0;
+	for (double t : samples)
+		squares += (t - result.mean_ns) * (t - result.mean_ns);
+	result.stddev_ns = std::sqrt(squares / (BENCH_SAMPLES - 1));
+	result.ci95_ns = BENCH_T95 * result.stddev_ns / std::sqrt((double) BENCH_SAMPLES);
+
+	std::sort(samples, samples + BENCH_SAMPLES);
+	result.min_ns = samples[0];
+	result.median_ns = samples[BENCH_SAMPLES / 2];
+	return result;
+}
+
+void print_bench_result(const char* name, const bench_result& r)
+{
+	printf("%-38s %9.2f %8.2f %9.2f %9.2f %10.2f %6.1f", name, r.median_ns, r.ci95_ns, r.mean_ns, r.min_ns,
+		1e3 / r.median_ns, 100 * r.stddev_ns / r.mean_ns);
+	if (r.has_hw)
+		print_hw_counters(r.hw, r.hw_ops);
+	printf("\n");
+}
+
+// Shading inputs of a primary ray that hit something
+struct bench_hit
+{
+	glm::vec3 point;
+	glm::vec3 normal;
+	glm::vec3 view;
+};
+
+// Times the raytrace.h kernels on the prepared scene with fixed pseudo
+// random camera rays, so runs are comparable across builds
+int run_kernel_benchmarks(geometry_scene& scene)
+{
+	int cpu = pin_to_current_cpu();
+	if (cpu >= 0)
+		printf("Kernel benchmarks pinned to CPU %d\n", cpu);
+	else
+		printf("Kernel benchmarks not pinned\n");
+	if (RENDER_STATS)
+		printf("RENDER_STATS is on, kernels include their counters\n");
+	if (hw_config.enabled)
+		printf(hw_counters_active() ? "Hardware counters per op follow the timings\n" : "Hardware counters unavailable\n");
+
+	glm::vec3 origin = { 0, 0, 0 };
+	prepare_primary_rays(scene, origin);
+
+	std::mt19937 rng(12345);
+	std::uniform_real_distribution<float> across(-0.9f, 0.9f);
+	std::uniform_real_distribution<float> up(-0.5f, 0.5f);
+
+	std::vector<ray> rays(BENCH_INPUTS);
+	for (ray& r : rays)
+	{
+		r.origin = origin;
+		r.direction = { across(rng), up(rng), 1 };
+		r.t_min = 1;
+		r.t_max = std::numeric_limits<float>::infinity();
+	}
+
+	// Hit points of the rays, repeated to fill BENCH_INPUTS
+	std::vector<bench_hit> hits;
+	for (ray& r : rays)
+	{
+		hit_record hit = closest_intersection(r, scene);
+		if (hit.hit_sphere == nullptr && hit.hit_plane == nullptr)
+			continue;
+
+		glm::vec3 point = r.get_point(hit.t);
+		surface surf = hit.hit_sphere != nullptr ? sphere_surface(*hit.hit_sphere, point) : plane_surface(*hit.hit_plane, r.direction);
+		hits.push_back({ point, surf.normal, -r.direction });
+	}
+	for (size_t i = 0; !hits.empty() && hits.size() < BENCH_INPUTS; i++)
+		hits.push_back(hits[i]);
+
+	printf("%-38s %9s %8s %9s %9s %10s %6s\n", "kernel", "ns/op", "+-95%", "mean", "min", "Mops/s", "cv%");
+
+	if (!scene.spheres.empty())
+	{
+		int sphere_count = (int) scene.spheres.size();
+		print_bench_result("intersect_sphere", run_kernel_bench([&](int i)
+		{
+			sphere_roots roots = intersect_sphere(rays[i], scene.spheres[i % sphere_count]);
+			return roots.hit ? roots.t0 + roots.t1 : 0.0f;
+		}));
+	}
+
+	if (!scene.planes.empty())
+	{
+		print_bench_result("intersect_plane", run_kernel_bench([&](int i)
+		{
+			plane_root root = intersect_plane(rays[i], scene.planes[0]);
+			return root.hit ? root.t : 0.0f;
+		}));
+	}
+
+	print_bench_result("closest_sphere_intersection", run_kernel_bench([&](int i)
+	{
+		return closest_sphere_intersection(rays[i], scene).t;
+	}));
+
+	print_bench_result("reflect", run_kernel_bench([&](int i)
+	{
+		return reflect(rays[i].direction, rays[(i + 1) & (BENCH_INPUTS - 1)].direction).x;
+	}));
+
+	// One light at a time, so each type is timed on its own
+	static const struct { const char* name; light l; } lights[] =
+	{
+		{ "ambient", { {}, {}, 0.2f, AMBIENT } },
+		{ "point", { { 2, 1, 0 }, {}, 0.6f, POINT } },
+		{ "directional", { {}, { 1, 4, 4 }, 0.2f, DIRECTIONAL } }
+	};
+
+	if (!hits.empty())
+	{
+		geometry_scene lit = scene;
+		char name[64];
+
+		for (const auto& entry : lights)
+		{
+			lit.lights = { entry.l };
+			for (int specular : { -1, 500 })
+			{
+				snprintf(name, sizeof(name), "compute_lighting %s%s", entry.name, specular == -1 ? "" : " specular");
+				print_bench_result(name, run_kernel_bench([&](int i)
+				{
+					bench_hit& h = hits[i];
+					return compute_lighting(lit, h.point, h.view, h.normal, specular);
+				}));
+			}
+		}
+	}
+
+	glm::vec3 back_color = { 0, 0, 0 };
+	for (int depth = 0; depth <= 3; depth++)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "trace_scene depth %d", depth);
+		print_bench_result(name, run_kernel_bench([&](int i)
+		{
+			return trace_scene(rays[i], scene, back_color, depth).x;
+		}));
+	}
+
+	return 0;
+}
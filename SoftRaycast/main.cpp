@@ -2,6 +2,13 @@
 #include <vector>
 #include <SDL.h>
 #include <string>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <cmath>
+#include <algorithm>
+#include <filesystem>
+#include <memory>
 
 #include "glm/vec3.hpp"
 #include "glm/vec2.hpp"
@@ -14,15 +21,36 @@
 #include "raytrace.h"
 #include "util.h"	
 #include "camera.h"
+#include "framebuffer.h"
+#include "job_system.h"
+#include "ray_packet.h"
+#include "wavefront.h"
+#include "camera_rays.h"
+#include "pixel_order.h"
+#include "render_settings.h"
+#include "alloc_counter.h"
+#include "render_stats.h"
+#include "timeline.h"
+#include "cost_heatmap.h"
+#include "kernel_bench.h"
+#include "scene_generator.h"
+#include "golden_image.h"
+#include "simd_check.h"
+#include "hw_counters.h"
+#include "frame_timing.h"
 
-#define SHUTDOWN_AFTER_RENDER 0
-#define GENERATE_SCREENSHOT 1
-#define REFLECTION_MAX_DEPTH 2
+// Resolution, reflection depth, threads and the output switches are
+// runtime settings now (render_settings.h)
+#define TILE_SIZE 32
+// Visiting order of tiles and of the pixels inside a tile (pixel_order.h)
+#define PIXEL_ORDER ORDER_MORTON
+// Trace primary rays in PACKET_WIDTH x PACKET_HEIGHT packets (ray_packet.h)
+#define RAY_PACKETS 1
+// Trace each tile bounce by bounce through ray queues (wavefront.h) instead
+// of recursing per pixel or per packet
+#define WAVEFRONT_RENDER 1
 
-const int SCREEN_WIDTH = 1920; // 16 * 80;
-const int SCREEN_HEIGHT = 1080; // 9  80;
-const int CANVAS_WIDTH = SCREEN_WIDTH;
-const int CANVAS_HEIGHT = SCREEN_HEIGHT;
+static_assert(!WAVEFRONT_RENDER || TILE_SIZE * TILE_SIZE <= WAVEFRONT_MAX_RAYS, "a tile must fit in one wavefront");
 
 struct render_context 
 {
@@ -32,137 +60,308 @@ struct render_context
 	int canvas_height;
 	glm::vec2 viewport;
 	float distance;
+	int reflection_max_depth;
+	job_system* jobs;
+	camera_ray_generator* camera_rays;
+	frame_traversal* traversal;
+	// Receives the counters of each frame, may be null
+	render_stats* stats;
+	// Records the cost of every pixel when set (cost_heatmap.h)
+	cost_heatmap* heatmap;
+	// Hardware counts of the tile and linearize work of a frame, may be null
+	hw_counter_totals* hw_trace;
+	hw_counter_totals* hw_linearize;
+	// Receives the stage times of each frame but STAGE_PRESENT, may be null
+	frame_stage_times* stages;
+	// Traces every pixel on its own with trace_scene, the reference the
+	// packet and wavefront paths are checked against in run_regression
+	bool scalar_reference;
 } context;
 
-void draw_pixel(SDL_Renderer * r, int x, int y, SDL_Color color);
-void render_scene(const render_context& context, SDL_Renderer* renderer, geometry_scene& scene, camera& camera);
-
-void draw_pixel(SDL_Renderer *r, int x, int y, SDL_Color color)
-{
-	SDL_SetRenderDrawColor(r, color.r, color.g, color.b, color.a);
-	SDL_RenderDrawPoint(r, x, y);
-}
+void render_scene(const render_context& context, framebuffer& frame, geometry_scene& scene, camera& camera);
 
 glm::vec3 canvas_to_viewport(float cx, float cy, const render_context & context)
 {
 	return glm::vec3
 	{
-		cx * (context.viewport.x / CANVAS_WIDTH),
-		cy * (context.viewport.y / CANVAS_HEIGHT),
+		cx * (context.viewport.x / context.canvas_width),
+		cy * (context.viewport.y / context.canvas_height),
 		context.distance
 	};
 }
 
 
 
-void render_scene(const render_context& context, SDL_Renderer* renderer, geometry_scene & scene, camera & camera)
+// Traces a tile one pixel at a time. With a heatmap it also records what
+// each pixel cost: the packet and wavefront paths share work between pixels,
+// so the cost is taken on this path, whose image matches theirs within the
+// regression tolerance.
+void render_tile_scalar(const render_context& context, framebuffer& frame, geometry_scene& scene, int x0, int y0, int x1, int y1,
+	cost_heatmap* heatmap = nullptr)
 {
-	glm::vec3 back_color = { 0, 0, 0};
-	glm::vec3 color = back_color;
-	glm::quat q{ camera.orientation };
-	glm::mat4 camera_rotation = glm::mat4_cast(q);
+	glm::vec3 back_color = { 0, 0, 0 };
 
-	ray r;
-	
-    int half_w = context.screen_width/2;
-    int half_h = context.screen_height/2;
+	for (const glm::ivec2& p : context.traversal->tile_pixels)
+	{
+		int sx = x0 + p.x;
+		int sy = y0 + p.y;
+		if (sx >= x1 || sy >= y1)
+			continue;
 
-	for (int cx = -half_w; cx < half_w; cx++)
+		unsigned long long before = heatmap != nullptr ? heatmap_sample(heatmap->metric) : 0;
+		ray r = context.camera_rays->get_ray(sx, sy);
+		glm::vec3 color = trace_scene(r, scene, back_color, context.reflection_max_depth);
+		frame.set_pixel(sx, sy, color);
+		if (heatmap != nullptr)
+			heatmap->set(sx, sy, heatmap_sample(heatmap->metric) - before);
+	}
+}
+
+void render_tile(const render_context& context, framebuffer& frame, geometry_scene& scene, int x0, int y0, int x1, int y1)
+{
+	if (context.heatmap != nullptr)
 	{
-		for (int cy = -half_h; cy < half_h; cy++)
-		{
-			glm::vec3 viewport_point = camera_rotation * glm::vec4(canvas_to_viewport(cx, cy, context), 1);
-           
-			r.origin = camera.origin;
-			r.direction = viewport_point - r.origin;
-			r.t_min = 1;
-			r.t_max = std::numeric_limits<float>::infinity();
+		render_tile_scalar(context, frame, scene, x0, y0, x1, y1, context.heatmap);
+		return;
+	}
+
+#if WAVEFRONT_RENDER || RAY_PACKETS
+	if (context.scalar_reference)
+	{
+		render_tile_scalar(context, frame, scene, x0, y0, x1, y1);
+		return;
+	}
+
+	glm::vec3 back_color = { 0, 0, 0 };
+	const camera_ray_generator& camera_rays = *context.camera_rays;
+	const frame_traversal& traversal = *context.traversal;
 
-			int sx = context.canvas_width / 2 + cx;
-			int sy = context.canvas_height / 2 - cy - 1;
+#if WAVEFRONT_RENDER
+	wavefront_state& state = wavefront_buffers;
+	int tile_width = x1 - x0;
 
-			if (sx < 0 || sx >= context.canvas_width ||
-				sy < 0 || sy >= context.canvas_height) continue;
+	// Queue order decides which rays share a packet in every stage
+	state.queues[0].clear();
+	for (const glm::ivec2& p : traversal.tile_pixels)
+	{
+		int sx = x0 + p.x;
+		int sy = y0 + p.y;
+		if (sx < x1 && sy < y1)
+			state.queues[0].push(camera_rays.get_ray(sx, sy), p.y * tile_width + p.x, 1);
+	}
+
+	trace_wavefront(state, tile_width * (y1 - y0), scene, back_color, context.reflection_max_depth);
 
+	for (int sy = y0; sy < y1; sy++)
+		for (int sx = x0; sx < x1; sx++)
+			frame.set_pixel(sx, sy, state.color[(sy - y0) * tile_width + (sx - x0)]);
+#elif RAY_PACKETS
+	ray_packet packet;
+	glm::vec3 colors[PACKET_LANES];
+
+	for (const glm::ivec2& p : traversal.tile_packets)
+	{
+		int bx = x0 + p.x;
+		int by = y0 + p.y;
+		if (bx >= x1 || by >= y1)
+			continue;
+
+		packet.clear();
+		for (int sy = by; sy < glm::min(by + PACKET_HEIGHT, y1); sy++)
+			for (int sx = bx; sx < glm::min(bx + PACKET_WIDTH, x1); sx++)
+				packet.set_ray((sy - by) * PACKET_WIDTH + (sx - bx), camera_rays.get_ray(sx, sy));
+
+		trace_packet(packet, scene, back_color, context.reflection_max_depth, colors);
+
+		for (int sy = by; sy < glm::min(by + PACKET_HEIGHT, y1); sy++)
+			for (int sx = bx; sx < glm::min(bx + PACKET_WIDTH, x1); sx++)
+				frame.set_pixel(sx, sy, colors[(sy - by) * PACKET_WIDTH + (sx - bx)]);
+	}
+#endif
+#else
+	render_tile_scalar(context, frame, scene, x0, y0, x1, y1);
+#endif
+}
+
+void render_scene(const render_context& context, framebuffer& frame, geometry_scene & scene, camera & camera)
+{
+	TIMELINE_ZONE("render_scene");
+	ALLOC_SCOPE(ALLOC_TRACE);
+	frame_traversal& traversal = *context.traversal;
+
+	stage_timing = context.stages != nullptr;
+	wavefront_trace_ns = 0;
+	wavefront_shade_ns = 0;
+	long long setup_begin = stage_clock_ns();
+
+	{
+		TIMELINE_ZONE("prepare_frame");
+		// canvas_to_viewport(1, 1) is the per-unit viewport scale plus the distance
+		context.camera_rays->prepare(camera, context.canvas_width, context.canvas_height, canvas_to_viewport(1, 1, context));
+		prepare_primary_rays(scene, camera.origin);
+		traversal.prepare(PIXEL_ORDER, context.canvas_width, context.canvas_height, TILE_SIZE, PACKET_WIDTH, PACKET_HEIGHT);
+	}
+
+	// Heap allocations made while tracing, only counted in debug builds
+	std::atomic<unsigned long long> trace_allocations{ 0 };
+	long long trace_begin = stage_clock_ns();
+
+	context.jobs->parallel_for((int) traversal.tiles.size(), [&](int tile)
+	{
+		TIMELINE_ZONE_ID("tile", tile);
+		ALLOC_SCOPE(ALLOC_TRACE);
+		hw_counter_zone counters(context.hw_trace);
+		int x0 = traversal.tiles[tile].x * TILE_SIZE;
+		int y0 = traversal.tiles[tile].y * TILE_SIZE;
+		int x1 = glm::min(x0 + TILE_SIZE, context.canvas_width);
+		int y1 = glm::min(y0 + TILE_SIZE, context.canvas_height);
+
+		unsigned long long allocations_before = allocation_count();
+		render_tile(context, frame, scene, x0, y0, x1, y1);
+		trace_allocations += allocation_count() - allocations_before;
+	});
+
+	assert(trace_allocations == 0 && "the trace path must not allocate");
+
+	// Always collected so the per-thread counters start every frame at zero
+	render_stats frame_stats;
+	collect_render_stats(context.stats != nullptr ? *context.stats : frame_stats);
+	long long linearize_begin = stage_clock_ns();
+
+	context.jobs->parallel_for(frame.linearize_tasks(), [&](int task)
+	{
+		TIMELINE_ZONE_ID("linearize", task);
+		ALLOC_SCOPE(ALLOC_OUTPUT);
+		hw_counter_zone counters(context.hw_linearize);
+		frame.linearize(task);
+	});
 
-			color = trace_scene(r, scene, back_color, REFLECTION_MAX_DEPTH);
-			
-			
-			SDL_Color colr = { color.x, color.y, color.z };
-     
-            draw_pixel(renderer, sx, sy, colr);
+	if (context.stages != nullptr)
+	{
+		frame_stage_times& stages = *context.stages;
+		long long end = stage_clock_ns();
+		long long tile_ns = linearize_begin - trace_begin;
+		long long thread_ns = wavefront_trace_ns + wavefront_shade_ns;
+		double shade_share = thread_ns > 0 ? (double) wavefront_shade_ns / thread_ns : 0;
+
+		stages.ms[STAGE_FRAME_SETUP] = (trace_begin - setup_begin) / 1e6;
+		stages.ms[STAGE_TRACE] = tile_ns * (1 - shade_share) / 1e6;
+		stages.ms[STAGE_SHADE] = tile_ns * shade_share / 1e6;
+		stages.ms[STAGE_LINEARIZE] = (end - linearize_begin) / 1e6;
+	}
+}
+
+// Hands the framebuffer to SDL through a streaming texture, one upload per frame
+void present_framebuffer(SDL_Renderer* renderer, SDL_Texture* texture, const framebuffer& frame)
+{
+	TIMELINE_ZONE("present_framebuffer");
+	ALLOC_SCOPE(ALLOC_SDL);
+	void* texture_pixels;
+	int texture_pitch;
+
+	if (SDL_LockTexture(texture, NULL, &texture_pixels, &texture_pitch) == 0)
+	{
+		const Uint8* src = (const Uint8*) frame.pixels.data();
+		Uint8* dst = (Uint8*) texture_pixels;
+
+		if (texture_pitch == frame.pitch())
+		{
+			memcpy(dst, src, (size_t) frame.pitch() * frame.height);
 		}
+		else
+		{
+			for (int y = 0; y < frame.height; y++)
+				memcpy(dst + (size_t) y * texture_pitch, src + (size_t) y * frame.pitch(), frame.pitch());
+		}
+
+		SDL_UnlockTexture(texture);
+	}
+	else
+	{
+		SDL_UpdateTexture(texture, NULL, frame.pixels.data(), frame.pitch());
 	}
 
+	SDL_RenderCopy(renderer, texture, NULL, NULL);
+	SDL_RenderPresent(renderer);
 }
 
-void save_renderer_state_as_BMP(SDL_Renderer * renderer, const char * file_name)
+void save_renderer_state_as_BMP(const framebuffer& frame, const char * file_name)
 {
-	SDL_Surface* sshot = SDL_CreateRGBSurface
+	TIMELINE_ZONE("save_bmp");
+	ALLOC_SCOPE(ALLOC_OUTPUT);
+	SDL_Surface* sshot = SDL_CreateRGBSurfaceFrom
 	(
-		0, 
-		CANVAS_WIDTH, 
-		CANVAS_HEIGHT, 
-		32, 
-		0x00ff0000, 
-		0x0000ff00, 
-		0x000000ff, 
+		(void*) frame.pixels.data(),
+		frame.width,
+		frame.height,
+		32,
+		frame.pitch(),
+		0x00ff0000,
+		0x0000ff00,
+		0x000000ff,
 		0xff000000
 	);
-	
-	SDL_RenderReadPixels
-	(
-		renderer, 
-		NULL,
-		SDL_PIXELFORMAT_ARGB8888, 
-		sshot->pixels, 
-		sshot->pitch
-	);
 
 	SDL_SaveBMP(sshot, file_name);
 	SDL_FreeSurface(sshot);
 }
 
+// Images being written at once; save only waits when all are busy
+#define IMAGE_WRITER_SLOTS 3
 
-int main(int argc, char** argv)
+// Encodes and writes BMPs as jobs, so saving a frame overlaps tracing the
+// next one. Each save copies the image, so the caller can reuse it at once.
+struct image_writer
 {
-	
+	struct slot
+	{
+		framebuffer image;
+		char path[256];
+		job_counter written;
 
-	SDL_Init(SDL_INIT_EVERYTHING);
-	SDL_Window* window = SDL_CreateWindow
-	(
-		"SoftRaycaster",
-		SDL_WINDOWPOS_CENTERED,
-		SDL_WINDOWPOS_CENTERED,
-		SCREEN_WIDTH,
-		SCREEN_HEIGHT,
-		0
-	);
+		void operator()() const
+		{
+			save_renderer_state_as_BMP(image, path);
+		}
+	};
 
-	SDL_Renderer* renderer = SDL_CreateRenderer
-	(
-		window,
-		-1,
-		SDL_RENDERER_ACCELERATED | 
-        SDL_RENDERER_PRESENTVSYNC | 
-        SDL_RENDERER_TARGETTEXTURE
-	);
+	job_system& jobs;
+	slot slots[IMAGE_WRITER_SLOTS];
+	int next = 0;
 
+	image_writer(job_system& jobs) : jobs(jobs) {}
 
-	context.canvas_width = CANVAS_WIDTH;
-	context.canvas_height = CANVAS_HEIGHT;
-	const float aspect_ratio = (float) CANVAS_WIDTH / (float) CANVAS_HEIGHT;
-	context.viewport = { aspect_ratio , 1 };
-	context.distance = 1;
-	context.screen_width = SCREEN_WIDTH;
-	context.screen_height = SCREEN_HEIGHT;
+	~image_writer()
+	{
+		flush();
+	}
 
-	
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
+	void save(const framebuffer& frame, const char* file_name)
+	{
+		ALLOC_SCOPE(ALLOC_OUTPUT);
+		slot& s = slots[next];
+		next = (next + 1) % IMAGE_WRITER_SLOTS;
 
+		jobs.wait(s.written);
+		s.image.width = frame.width;
+		s.image.height = frame.height;
+		s.image.pixels = frame.pixels;
+		snprintf(s.path, sizeof(s.path), "%s", file_name);
+		jobs.spawn(s.written, s);
+	}
 
-	geometry_scene scene;
+	// Returns once every image is on disk
+	void flush()
+	{
+		for (slot& s : slots)
+			jobs.wait(s.written);
+	}
+};
 
+
+void build_demo_scene(geometry_scene& scene)
+{
+	ALLOC_SCOPE(ALLOC_SCENE_BUILD);
 	scene.spheres.push_back({ .center = {0, 0, 13}, .radius = 1, .color = {194, 14, 14}, 
 		.specular=500, .reflective = 0.4});
 
@@ -174,7 +373,8 @@ int main(int argc, char** argv)
 
 	//scene.spheres.push_back({ .center = {1, -0.2, 2}, .radius = 0.2, .color = {49, 68, 235}, .specular=10 });
 
-	scene.spheres.push_back({ .center = {0, -5001, 0}, .radius = 5000, .color = {255, 255, 0},
+	// Ground, the top of the old radius 5000 sphere at y = -5001
+	scene.planes.push_back({ .normal = {0, 1, 0}, .point = {0, -1, 0}, .color = {255, 255, 0},
 		.specular = 1000, .reflective = 0.2 });
 	
 	//scene.spheres.push_back({ .center = {0, -1, 3}, .radius = 1, .color = {255, 0, 0}, 
@@ -189,8 +389,671 @@ int main(int argc, char** argv)
 	scene.lights.push_back({ .intensity = 0.2, .type = AMBIENT });
 	scene.lights.push_back({ .origin = {2,  1 , 0}, .intensity = 0.6, .type = POINT });
 	scene.lights.push_back({ .direction = {1, 4, 4}, .intensity = 0.2, .type = DIRECTIONAL });
+}
 
-	
+// Canvas size and the matching viewport, keeping the aspect ratio
+void set_canvas(render_context& context, int width, int height)
+{
+	context.canvas_width = width;
+	context.canvas_height = height;
+	const float aspect_ratio = (float) width / (float) height;
+	context.viewport = { aspect_ratio , 1 };
+	context.distance = 1;
+}
+
+// Row of a sweep, kept to fit the scaling summary
+struct sweep_result
+{
+	int spheres;
+	int lights;
+	glm::ivec2 resolution;
+	int depth;
+	int threads;
+	double mean_ms;
+};
+
+// For every combination of the other parameters, fits mean_ms ~ spheres^k by
+// least squares on the logs. k near 1 means each ray pays for every sphere,
+// near 0 that the sphere count hardly matters.
+void print_sphere_scaling(const std::vector<sweep_result>& results)
+{
+	std::vector<bool> used(results.size(), false);
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		if (used[i])
+			continue;
+
+		const sweep_result& group = results[i];
+		double sx = 0, sy = 0, sxx = 0, sxy = 0;
+		int n = 0;
+		int fewest = group.spheres;
+		int most = group.spheres;
+
+		for (size_t j = i; j < results.size(); j++)
+		{
+			const sweep_result& r = results[j];
+			if (r.lights != group.lights || r.resolution != group.resolution || r.depth != group.depth || r.threads != group.threads)
+				continue;
+
+			used[j] = true;
+			if (r.spheres <= 0 || r.mean_ms <= 0)
+				continue;
+
+			double x = std::log((double) r.spheres);
+			double y = std::log(r.mean_ms);
+			sx += x;
+			sy += y;
+			sxx += x * x;
+			sxy += x * y;
+			n++;
+			fewest = glm::min(fewest, r.spheres);
+			most = glm::max(most, r.spheres);
+		}
+
+		if (n < 2 || fewest == most)
+			continue;
+
+		double k = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+		printf("%dx%d depth %d, %d threads, %d lights per type: frame time ~ spheres^%.2f over %d..%d spheres\n",
+			group.resolution.x, group.resolution.y, group.depth, group.threads, group.lights, k, fewest, most);
+	}
+}
+
+// Renders every spheres x lights x resolution x depth x thread count
+// combination of the sweep settings and writes one CSV row per combination.
+// Sphere and light counts regenerate the scene, so they need a generated one.
+// Each combination gets a warm-up frame, then sweep_frames timed frames.
+int run_sweep(const render_settings& settings, render_context& context, geometry_scene& scene)
+{
+	bool generated = settings.scene.layout != SCENE_DEMO;
+	if (!generated && (!settings.sweep_spheres.empty() || !settings.sweep_lights.empty()))
+	{
+		printf("sweep-spheres and sweep-lights need a generated scene (--scene uniform, clustered or stacked)\n");
+		return 1;
+	}
+
+	std::ofstream csv(settings.sweep_csv);
+	if (!csv)
+	{
+		printf("Cannot write '%s'\n", settings.sweep_csv.c_str());
+		return 1;
+	}
+
+	std::vector<int> sphere_counts = settings.sweep_spheres;
+	if (sphere_counts.empty())
+		sphere_counts.push_back(generated ? settings.scene.spheres : (int) scene.spheres.size());
+
+	std::vector<int> light_counts = settings.sweep_lights;
+	if (light_counts.empty())
+		light_counts.push_back(generated ? settings.scene.lights : 0);
+
+	std::vector<glm::ivec2> resolutions = settings.sweep_resolutions;
+	if (resolutions.empty())
+		resolutions.push_back({ settings.canvas_w(), settings.canvas_h() });
+
+	std::vector<int> depths = settings.sweep_depths;
+	if (depths.empty())
+		depths.push_back(settings.reflection_max_depth);
+
+	std::vector<int> thread_counts = settings.sweep_threads;
+	if (thread_counts.empty())
+		thread_counts.push_back(settings.render_threads);
+
+	csv << "scene,spheres,lights,width,height,depth,threads,frames,mean_ms,min_ms,max_ms,primary_rays_per_s\n";
+
+	camera c = { .origin = {0, 0, 0}, .orientation{0, 0, 0} };
+	framebuffer frame;
+	std::vector<sweep_result> results;
+
+	for (int spheres : sphere_counts)
+	{
+		for (int lights : light_counts)
+		{
+			if (generated)
+			{
+				scene_params params = settings.scene;
+				params.spheres = spheres;
+				params.lights = lights;
+				generate_scene(scene, params);
+				prepare_scene(scene, *context.jobs);
+			}
+
+			for (int threads : thread_counts)
+			{
+				// The whole sweep shares one set of threads, except where it
+				// asks for another count
+				job_system* shared_jobs = context.jobs;
+				std::unique_ptr<job_system> sweep_jobs;
+				if (threads != settings.render_threads)
+				{
+					sweep_jobs.reset(new job_system(threads, settings.main_thread_jobs));
+					context.jobs = sweep_jobs.get();
+				}
+				int thread_count = context.jobs->size();
+
+				for (const glm::ivec2& resolution : resolutions)
+				{
+					set_canvas(context, resolution.x, resolution.y);
+					frame.resize(resolution.x, resolution.y);
+
+					for (int depth : depths)
+					{
+						context.reflection_max_depth = depth;
+						render_scene(context, frame, scene, c);
+
+						double total = 0;
+						double fastest = std::numeric_limits<double>::max();
+						double slowest = 0;
+						for (int f = 0; f < settings.sweep_frames; f++)
+						{
+							auto frame_begin = std::chrono::steady_clock::now();
+							render_scene(context, frame, scene, c);
+							std::chrono::duration<double, std::milli> frame_time = std::chrono::steady_clock::now() - frame_begin;
+
+							total += frame_time.count();
+							fastest = glm::min(fastest, frame_time.count());
+							slowest = glm::max(slowest, frame_time.count());
+						}
+
+						double mean = total / settings.sweep_frames;
+						double rays_per_s = (double) resolution.x * resolution.y / (mean / 1000);
+						results.push_back({ spheres, lights, resolution, depth, thread_count, mean });
+
+						printf("%s, %d spheres, %d lights per type, %dx%d depth %d, %d threads: %.2f ms (%.2f Mrays/s)\n",
+							scene_layout_name(settings.scene.layout), spheres, lights, resolution.x, resolution.y, depth, thread_count, mean, rays_per_s / 1e6);
+						csv << scene_layout_name(settings.scene.layout) << ',' << spheres << ',' << lights << ','
+							<< resolution.x << ',' << resolution.y << ',' << depth << ',' << thread_count << ',' << settings.sweep_frames << ','
+							<< mean << ',' << fastest << ',' << slowest << ',' << rays_per_s << '\n';
+					}
+				}
+
+				context.jobs = shared_jobs;
+			}
+		}
+	}
+
+	print_sphere_scaling(results);
+	printf("Sweep written to %s\n", settings.sweep_csv.c_str());
+	return 0;
+}
+
+// Scenes the regression check renders, at REGRESSION_WIDTH x REGRESSION_HEIGHT
+// and depth 2 whatever the settings say, so golden images stay comparable
+#define REGRESSION_WIDTH 480
+#define REGRESSION_HEIGHT 270
+// Runs of the history with correct output the throughput baseline is the median of
+#define REGRESSION_BASELINE_RUNS 5
+// Fewer runs than this say nothing about the spread, so throughput is not
+// checked until the history has them
+#define REGRESSION_MIN_BASELINE_RUNS 3
+
+#define BUILD_SWITCH(name) (std::string(", " #name "=") + std::to_string(name))
+
+// Compiler, instruction set and the compile-time switches that change what
+// a frame costs, for the regression history
+std::string build_configuration()
+{
+#if defined(_MSC_VER)
+	std::string build = "msvc " + std::to_string(_MSC_VER);
+#elif defined(__clang__)
+	std::string build = "clang " + std::to_string(__clang_major__) + "." + std::to_string(__clang_minor__);
+#elif defined(__GNUC__)
+	std::string build = "gcc " + std::to_string(__GNUC__) + "." + std::to_string(__GNUC_MINOR__);
+#else
+	std::string build = "unknown compiler";
+#endif
+	build += ", SIMD_WIDTH=" + std::to_string(SIMD_WIDTH);
+#if defined(__FMA__) || (defined(_MSC_VER) && defined(__AVX2__))
+	build += ", fma";
+#endif
+#ifndef NDEBUG
+	build += ", asserts";
+#endif
+	return build + BUILD_SWITCH(RAY_PACKETS) + BUILD_SWITCH(WAVEFRONT_RENDER) + BUILD_SWITCH(USE_WIDE_BVH) + BUILD_SWITCH(WIDE_BVH_QUANTIZED) +
+		BUILD_SWITCH(FRAMEBUFFER_TILED) + BUILD_SWITCH(RENDER_STATS) + BUILD_SWITCH(COUNT_ALLOCATIONS) + BUILD_SWITCH(TIMELINE) +
+		BUILD_SWITCH(VALIDATE_SIMD_INTERSECTION);
+}
+
+struct regression_scene
+{
+	const char* name;
+	int layout;
+	int spheres;
+	float camera_y;
+};
+
+const regression_scene regression_scenes[] =
+{
+	{ "demo", SCENE_DEMO, 0, 0 },
+	{ "demo_high", SCENE_DEMO, 0, 2 },
+	{ "uniform_256", SCENE_UNIFORM, 256, 0 },
+	{ "clustered_1024", SCENE_CLUSTERED, 1024, 0 },
+	{ "stacked_128", SCENE_STACKED, 128, 0 }
+};
+
+// Renders every regression scene, compares it with its golden image and its
+// throughput with the history, and appends this run to the history. With
+// update_golden the renders become the new golden images instead. Returns 1
+// when an image differs or throughput fell below the baseline by more than
+// regress_threshold plus the spread of the baseline runs.
+int run_regression(const render_settings& settings, render_context& context)
+{
+	std::error_code error;
+	std::filesystem::create_directories(settings.golden_dir, error);
+	std::string history_path = settings.golden_dir + "/history.jsonl";
+
+	set_canvas(context, REGRESSION_WIDTH, REGRESSION_HEIGHT);
+	context.reflection_max_depth = 2;
+
+	framebuffer frame;
+	framebuffer golden;
+	framebuffer diff;
+	framebuffer reference;
+	frame.resize(REGRESSION_WIDTH, REGRESSION_HEIGHT);
+	reference.resize(REGRESSION_WIDTH, REGRESSION_HEIGHT);
+
+	// A first run has nothing to compare with: say how to create the golden
+	// images instead of failing every scene
+	if (!settings.update_golden)
+	{
+		bool any_golden = false;
+		for (const regression_scene& entry : regression_scenes)
+			any_golden = any_golden || std::filesystem::exists(settings.golden_dir + "/" + entry.name + ".bmp", error);
+
+		if (!any_golden)
+		{
+			printf("No golden images in '%s'. Run once with --update-golden on a build whose output is\n"
+				"trusted to create them, then --regress compares against them.\n", settings.golden_dir.c_str());
+			return 1;
+		}
+	}
+
+	// Throughput is only compared with runs of the same thread count, size
+	// and build
+	int threads = context.jobs->size();
+	std::string build = build_configuration();
+	std::string run_key = history_run_key(threads, REGRESSION_WIDTH, REGRESSION_HEIGHT, build);
+	bool have_baseline = history_baseline(history_path, regression_scenes[0].name, run_key, REGRESSION_BASELINE_RUNS).runs >= REGRESSION_MIN_BASELINE_RUNS;
+	printf("Build: %s\n", build.c_str());
+	bool all_passed = true;
+	std::string scenes_json;
+
+	printf("%-16s %9s %12s %12s %8s %9s  %s\n", "scene", "ms", "Mrays/s", "baseline", "max diff", "vs scalar", "result");
+
+	for (const regression_scene& entry : regression_scenes)
+	{
+		geometry_scene scene;
+		if (entry.layout == SCENE_DEMO)
+		{
+			build_demo_scene(scene);
+		}
+		else
+		{
+			scene_params params;
+			params.layout = entry.layout;
+			params.spheres = entry.spheres;
+			generate_scene(scene, params);
+		}
+		prepare_scene(scene, *context.jobs);
+
+		camera c = { .origin = {0, entry.camera_y, 0}, .orientation{0, 0, 0} };
+		render_scene(context, frame, scene, c);
+
+		// The timed frames follow a warm-up frame, so they must not allocate
+		std::vector<double> times;
+		times.reserve(settings.regress_frames);
+		alloc_counts allocs_before = alloc_snapshot();
+		for (int f = 0; f < settings.regress_frames; f++)
+		{
+			auto frame_begin = std::chrono::steady_clock::now();
+			render_scene(context, frame, scene, c);
+			std::chrono::duration<double, std::milli> frame_time = std::chrono::steady_clock::now() - frame_begin;
+			times.push_back(frame_time.count());
+		}
+		unsigned long long frame_allocations = (alloc_snapshot() - allocs_before).total();
+
+		// The wavefront and packet paths sum a pixel's bounces in another
+		// order than the recursive trace_scene, so their frames may differ
+		// in the last bit before quantization: they must stay within
+		// regress_tolerance of the per-pixel path
+		int scalar_difference = 0;
+		long long scalar_bad_pixels = 0;
+#if WAVEFRONT_RENDER || RAY_PACKETS
+		context.scalar_reference = true;
+		render_scene(context, reference, scene, c);
+		context.scalar_reference = false;
+		image_comparison scalar = compare_images(frame, reference, settings.regress_tolerance, diff);
+		scalar_difference = scalar.max_difference;
+		scalar_bad_pixels = scalar.bad_pixels;
+		if (scalar_bad_pixels > 0)
+			save_renderer_state_as_BMP(diff, (settings.golden_dir + "/" + entry.name + "_scalar_diff.bmp").c_str());
+#endif
+		// The fastest frame is the one least disturbed by the rest of the
+		// machine, so it varies least between runs
+		double ms = *std::min_element(times.begin(), times.end());
+		double rays_per_s = (double) REGRESSION_WIDTH * REGRESSION_HEIGHT / (ms / 1000);
+
+		std::string golden_path = settings.golden_dir + "/" + entry.name + ".bmp";
+		std::string result;
+		bool passed = true;
+		int max_difference = 0;
+
+		if (settings.update_golden)
+		{
+			save_renderer_state_as_BMP(frame, golden_path.c_str());
+			result = "golden updated";
+		}
+		else if (!load_bmp(golden_path.c_str(), golden))
+		{
+			passed = false;
+			result = "no golden image, run with --update-golden";
+		}
+		else
+		{
+			image_comparison comparison = compare_images(frame, golden, settings.regress_tolerance, diff);
+			max_difference = comparison.max_difference;
+
+			if (!comparison.same_size)
+			{
+				passed = false;
+				result = "golden image size differs";
+			}
+			else if (comparison.bad_pixels > 0)
+			{
+				passed = false;
+				result = std::to_string(comparison.bad_pixels) + " pixels differ, see " + entry.name + "_diff.bmp";
+				save_renderer_state_as_BMP(diff, (settings.golden_dir + "/" + entry.name + "_diff.bmp").c_str());
+				save_renderer_state_as_BMP(frame, (settings.golden_dir + "/" + entry.name + "_actual.bmp").c_str());
+			}
+			else
+			{
+				result = "ok";
+			}
+		}
+
+		if (scalar_bad_pixels > 0)
+		{
+			if (passed)
+				result.clear();
+			else
+				result += ", ";
+			result += std::to_string(scalar_bad_pixels) + " pixels differ from the scalar path, see " + entry.name + "_scalar_diff.bmp";
+			passed = false;
+		}
+
+		if (frame_allocations > 0)
+		{
+			if (passed)
+				result.clear();
+			else
+				result += ", ";
+			result += std::to_string(frame_allocations) + " allocations in steady state frames";
+			passed = false;
+		}
+
+		// A drop within the spread of the baseline runs is noise
+		history_throughput baseline = history_baseline(history_path, entry.name, run_key, REGRESSION_BASELINE_RUNS);
+		bool output_passed = passed;
+		if (!settings.update_golden && baseline.runs >= REGRESSION_MIN_BASELINE_RUNS && rays_per_s < baseline.median * (1 - settings.regress_threshold - baseline.spread))
+		{
+			if (passed)
+				result.clear();
+			else
+				result += ", ";
+			result += "throughput down " + std::to_string((int) (100 * (1 - rays_per_s / baseline.median))) + "%";
+			passed = false;
+		}
+
+		all_passed = all_passed && passed;
+		printf("%-16s %9.2f %12.2f %12.2f %8d %9d  %s\n", entry.name, ms, rays_per_s / 1e6, baseline.median / 1e6, max_difference, scalar_difference, result.c_str());
+
+		scenes_json += std::string(scenes_json.empty() ? "" : ",") + "{\"name\":\"" + entry.name + "\",\"ms\":" + std::to_string(ms) +
+			",\"rays_per_s\":" + std::to_string(rays_per_s) + ",\"max_difference\":" + std::to_string(max_difference) +
+			",\"scalar_difference\":" + std::to_string(scalar_difference) +
+			",\"output_passed\":" + (output_passed ? "true" : "false") + ",\"passed\":" + (passed ? "true" : "false") + "}";
+	}
+
+	long long now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	append_history(history_path, "{\"time\":" + std::to_string(now) + "," + run_key +
+		"\"update_golden\":" + (settings.update_golden ? "true" : "false") + ",\"passed\":" + (all_passed ? "true" : "false") +
+		",\"scenes\":[" + scenes_json + "]}");
+
+	if (!settings.update_golden && !have_baseline)
+		printf("Fewer than %d earlier runs of this build with %d threads at %dx%d and correct output, throughput is not checked yet\n",
+			REGRESSION_MIN_BASELINE_RUNS, threads, REGRESSION_WIDTH, REGRESSION_HEIGHT);
+	printf("Regression %s\n", all_passed ? "passed" : "FAILED");
+	return all_passed ? 0 : 1;
+}
+
+// Compares the SIMD sphere kernels with the scalar scan on the regression
+// scenes. Returns 1 when any of them disagrees.
+int run_simd_check(job_system& jobs)
+{
+	print_simd_check_header();
+
+	long long mismatches = 0;
+	unsigned seed = 1;
+	for (const regression_scene& entry : regression_scenes)
+	{
+		geometry_scene scene;
+		if (entry.layout == SCENE_DEMO)
+		{
+			// demo_high only moves the camera
+			if (entry.camera_y != 0)
+				continue;
+			build_demo_scene(scene);
+		}
+		else
+		{
+			scene_params params;
+			params.layout = entry.layout;
+			params.spheres = entry.spheres;
+			generate_scene(scene, params);
+		}
+		prepare_scene(scene, jobs);
+
+		mismatches += check_simd_kernels(entry.name, scene, seed++);
+	}
+
+	printf("SIMD check %s\n", mismatches == 0 ? "passed" : "FAILED");
+	return mismatches == 0 ? 0 : 1;
+}
+
+// Writes a frame that went over the frame budget as a config file that
+// renders it again with --config, its timings in the leading comments
+void log_slow_frame(const render_settings& settings, const camera& c, int number, double total_ms, const frame_stage_times& stages)
+{
+	ALLOC_SCOPE(ALLOC_OUTPUT);
+	std::error_code error;
+	std::filesystem::create_directories(settings.slow_frame_dir, error);
+
+	std::string path = settings.slow_frame_dir + "/frame_" + std::to_string(number) + ".cfg";
+	std::ofstream file(path);
+	if (!file)
+	{
+		printf("Cannot write '%s'\n", path.c_str());
+		return;
+	}
+
+	char line[256];
+	snprintf(line, sizeof(line), "# frame %d: %.2f ms, budget %.2f ms\n", number, total_ms, settings.frame_budget_ms);
+	file << line;
+	for (int s = 0; s < STAGE_COUNT; s++)
+	{
+		snprintf(line, sizeof(line), "#   %-12s %.2f ms\n", frame_stage_name(s), stages.ms[s]);
+		file << line;
+	}
+
+	const scene_params& scene = settings.scene;
+	file.precision(9);
+	file << "width = " << settings.screen_width << "\nheight = " << settings.screen_height << "\n";
+	file << "canvas-width = " << settings.canvas_w() << "\ncanvas-height = " << settings.canvas_h() << "\n";
+	file << "depth = " << settings.reflection_max_depth << "\nthreads = " << settings.render_threads << "\n";
+	file << "scene = " << scene_layout_name(scene.layout) << "\nseed = " << scene.seed << "\nspheres = " << scene.spheres
+		<< "\nlights = " << scene.lights << "\nreflective = " << scene.reflective_fraction << "\nground = " << (scene.ground ? "on" : "off") << "\n";
+
+	snprintf(line, sizeof(line), "camera-origin = %.9g,%.9g,%.9g\ncamera-orientation = %.9g,%.9g,%.9g\n",
+		c.origin.x, c.origin.y, c.origin.z, c.orientation.x, c.orientation.y, c.orientation.z);
+	file << line;
+
+	printf("Frame %d over budget, logged to %s\n", number, path.c_str());
+}
+
+int main(int argc, char** argv)
+{
+	auto startup_begin = std::chrono::steady_clock::now();
+
+	render_settings settings;
+	if (!parse_settings(settings, argc, argv))
+	{
+		print_settings_usage();
+		return 1;
+	}
+
+	bool headless = settings.headless || !settings.sweep_csv.empty() || settings.bench_kernels || settings.regress || settings.update_golden
+		|| settings.check_simd;
+	int canvas_width = settings.canvas_w();
+	int canvas_height = settings.canvas_h();
+
+	SDL_Window* window = nullptr;
+	SDL_Renderer* renderer = nullptr;
+	SDL_Texture* frame_texture = nullptr;
+
+	if (!headless)
+	{
+		ALLOC_SCOPE(ALLOC_SDL);
+		SDL_Init(SDL_INIT_EVERYTHING);
+		window = SDL_CreateWindow
+		(
+			"SoftRaycaster",
+			SDL_WINDOWPOS_CENTERED,
+			SDL_WINDOWPOS_CENTERED,
+			settings.screen_width,
+			settings.screen_height,
+			0
+		);
+
+		renderer = SDL_CreateRenderer
+		(
+			window,
+			-1,
+			SDL_RENDERER_ACCELERATED |
+			SDL_RENDERER_PRESENTVSYNC |
+			SDL_RENDERER_TARGETTEXTURE
+		);
+
+		frame_texture = SDL_CreateTexture
+		(
+			renderer,
+			SDL_PIXELFORMAT_ARGB8888,
+			SDL_TEXTUREACCESS_STREAMING,
+			canvas_width,
+			canvas_height
+		);
+	}
+
+	set_canvas(context, canvas_width, canvas_height);
+	context.screen_width = settings.screen_width;
+	context.screen_height = settings.screen_height;
+	context.reflection_max_depth = settings.reflection_max_depth;
+
+	camera_ray_generator camera_rays;
+	context.camera_rays = &camera_rays;
+
+	frame_traversal traversal;
+	context.traversal = &traversal;
+
+	if (!settings.timeline_json.empty())
+		timeline_start(settings.timeline_events);
+
+	job_system jobs(settings.render_threads, settings.main_thread_jobs);
+	context.jobs = &jobs;
+
+	if (settings.check_simd)
+		return run_simd_check(jobs);
+
+	geometry_scene scene;
+	if (settings.scene.layout == SCENE_DEMO)
+	{
+		build_demo_scene(scene);
+	}
+	else
+	{
+		generate_scene(scene, settings.scene);
+		printf("Scene: %s, %d spheres, %d lights, seed %d\n", scene_layout_name(settings.scene.layout),
+			(int) scene.spheres.size(), (int) scene.lights.size(), settings.scene.seed);
+	}
+
+	{
+		TIMELINE_ZONE("prepare_scene");
+		prepare_scene(scene, jobs);
+	}
+	if (scene.uses_bvh())
+	{
+		printf("BVH: %d spheres, %d nodes, %d leaves, depth %d, built in %.2f ms\n",
+			scene.sphere_bvh.sphere_count, scene.sphere_bvh.node_count, scene.sphere_bvh.leaf_count,
+			scene.sphere_bvh.depth, scene.sphere_bvh.build_ms);
+	}
+	if (!scene.sphere_wide_bvh.empty())
+	{
+		printf("Wide BVH: %d-ary, %d nodes, %d leaves, collapsed in %.2f ms\n",
+			WIDE_BVH_WIDTH, scene.sphere_wide_bvh.node_count, scene.sphere_wide_bvh.leaf_count,
+			scene.sphere_wide_bvh.build_ms);
+	}
+
+	if (settings.hw_counters)
+		hw_counters_enable(settings.hw_simd_event);
+
+	if (settings.bench_kernels)
+		return run_kernel_benchmarks(scene);
+
+	if (settings.regress || settings.update_golden)
+		return run_regression(settings, context);
+
+	if (!settings.sweep_csv.empty())
+		return run_sweep(settings, context, scene);
+
+	printf("Rendering %dx%d, depth %d, with %d threads\n", canvas_width, canvas_height, settings.reflection_max_depth, jobs.size());
+
+	framebuffer frame;
+	frame.resize(canvas_width, canvas_height);
+
+	render_stats stats;
+	context.stats = &stats;
+
+	hw_counter_totals hw_trace;
+	hw_counter_totals hw_linearize;
+	if (settings.hw_counters)
+	{
+		if (hw_counters_active())
+		{
+			context.hw_trace = &hw_trace;
+			context.hw_linearize = &hw_linearize;
+		}
+		else
+		{
+			printf("Hardware counters unavailable\n");
+		}
+	}
+
+	cost_heatmap heatmap;
+	framebuffer heatmap_image;
+	heatmap.metric = settings.heatmap;
+#if !RENDER_STATS
+	if (settings.stats != STATS_OUTPUT_OFF)
+		printf("Built without RENDER_STATS, the stats are all zero\n");
+	if (heatmap.metric == HEATMAP_RAYS || heatmap.metric == HEATMAP_TESTS)
+	{
+		printf("Built without RENDER_STATS, the heatmap measures cycles instead\n");
+		heatmap.metric = HEATMAP_CYCLES;
+	}
+#endif
+	if (heatmap.metric != HEATMAP_OFF)
+	{
+		heatmap.resize(canvas_width, canvas_height);
+		context.heatmap = &heatmap;
+	}
 
 	//var camera_position = [3, 0, 1];
 	//var camera_rotation = [[0.7071, 0, -0.7071],
@@ -198,19 +1061,98 @@ int main(int argc, char** argv)
 	//	[0.7071, 0, 0.7071]];
 
 
-	camera c = { .origin = {0, 0, 0}, .orientation{0, 0, 0} };
+	image_writer writer(jobs);
+	frame_recorder recorder;
+	frame_stage_times stages;
+	context.stages = &stages;
+	int frame_number = 0;
+
+	if (settings.allocs && !COUNT_ALLOCATIONS)
+		printf("Built without COUNT_ALLOCATIONS, allocations are not tracked\n");
+	// Frames after the first that allocated on the render path
+	int allocating_frames = 0;
+
+	// Renders and presents one frame, recording its time and logging it when
+	// it is over budget. Returns the render time, without presenting.
+	auto render_frame = [&](camera& c) -> double
+	{
+		alloc_counts allocs_before = alloc_snapshot();
+		auto frame_begin = std::chrono::steady_clock::now();
+		render_scene(context, frame, scene, c);
+		std::chrono::duration<double, std::milli> frame_time = std::chrono::steady_clock::now() - frame_begin;
+
+		unsigned long long render_allocs = render_allocations(alloc_snapshot() - allocs_before);
+		if (frame_number > 0 && render_allocs > 0)
+		{
+			printf("Frame %d made %llu allocations on the render path\n", frame_number, render_allocs);
+			allocating_frames++;
+		}
+
+		long long present_begin = stage_clock_ns();
+		if (!headless)
+			present_framebuffer(renderer, frame_texture, frame);
+		stages.ms[STAGE_PRESENT] = (stage_clock_ns() - present_begin) / 1e6;
+
+		double total_ms = frame_time.count() + stages.ms[STAGE_PRESENT];
+		recorder.record(total_ms, stages);
+		if (settings.frame_budget_ms > 0 && total_ms > settings.frame_budget_ms)
+			log_slow_frame(settings, c, frame_number, total_ms, stages);
+		frame_number++;
+		return frame_time.count();
+	};
+
+	std::chrono::duration<double, std::milli> startup_time = std::chrono::steady_clock::now() - startup_begin;
+	printf("Startup: %.2f ms (%s)\n", startup_time.count(), headless ? "headless" : "windowed");
+
+	camera c = { .origin = settings.camera_origin, .orientation = settings.camera_orientation };
 	for (int y = 0; y <= 5; y++)
 	{
-		SDL_RenderClear(renderer);
 		//float rad = glm::radians((float)deg);
 		//c.orientation.y = rad;
-		c.origin.y = y;
-		render_scene(context, renderer, scene, c);
-		SDL_RenderPresent(renderer);
+		if (!settings.camera_set)
+			c.origin.y = y;
+		TIMELINE_ZONE_ID("frame", y);
+
+		hw_trace.clear();
+		hw_linearize.clear();
+		alloc_counts allocs_before = alloc_snapshot();
+
+		double frame_ms = render_frame(c);
+		ALLOC_SCOPE(ALLOC_OUTPUT);
+		printf("Frame %d: %.2f ms\n", y, frame_ms);
+
+		if (context.hw_trace != nullptr)
+		{
+			double pixels = (double) canvas_width * canvas_height;
+			printf("  trace per pixel:");
+			print_hw_counters(hw_trace.load(), pixels);
+			printf("\n  linearize per pixel:");
+			print_hw_counters(hw_linearize.load(), pixels);
+			printf("\n");
+		}
+
+		if (settings.stats == STATS_OUTPUT_TEXT)
+			print_render_stats_text(stats, y);
+		else if (settings.stats == STATS_OUTPUT_JSON)
+			printf("%s\n", render_stats_json(stats, y, frame_ms).c_str());
+
+		char path[64];
+		snprintf(path, sizeof(path), "animation/%d.bmp", y);
+		writer.save(frame, path);
 
-		std::string s = "animation/" + std::to_string(y) + ".bmp";
-		save_renderer_state_as_BMP(renderer, s.c_str());
+		if (context.heatmap != nullptr)
+		{
+			print_heatmap_summary(heatmap, heatmap_to_framebuffer(heatmap, heatmap_image));
+			snprintf(path, sizeof(path), "animation/%d_cost.bmp", y);
+			writer.save(heatmap_image, path);
+		}
 
+		if (settings.allocs)
+		{
+			printf("  allocations: ");
+			print_alloc_counts(alloc_snapshot() - allocs_before);
+			printf("\n");
+		}
 	}
 /*
 
@@ -224,16 +1166,34 @@ int main(int argc, char** argv)
 
 
 
-	if (GENERATE_SCREENSHOT)
-		save_renderer_state_as_BMP(renderer, "reflective.bmp");
+	if (settings.generate_screenshot)
+	{
+		writer.save(frame, "reflective.bmp");
+		if (context.heatmap != nullptr)
+			writer.save(heatmap_image, "reflective_cost.bmp");
+	}
+	writer.flush();
 
-	if (SHUTDOWN_AFTER_RENDER)
-		return 0;
+	if (!settings.timeline_json.empty())
+	{
+		timeline_stop();
+		write_timeline(settings.timeline_json.c_str());
+	}
 
+	if (settings.shutdown_after_render || headless)
+	{
+		recorder.print_report();
+		return allocating_frames > 0 ? 1 : 0;
+	}
 
+	// WASD or the arrows move the camera, R and F raise and lower it, Q and E
+	// turn it; every move renders a frame that goes into the session report
+	const float move_step = 0.25f;
+	const float turn_step = glm::radians(5.0f);
 
 	do
 	{
+		ALLOC_SCOPE(ALLOC_SDL);
 		SDL_Event e;
 
 		if (SDL_PollEvent(&e))
@@ -243,12 +1203,37 @@ int main(int argc, char** argv)
 				printf("Click x,y : %d, %d", e.button.x, e.button.y);
 			}
 
+			if (e.type == SDL_KEYDOWN)
+			{
+				float yaw = c.orientation.y;
+				glm::vec3 forward = { glm::sin(yaw), 0, glm::cos(yaw) };
+				glm::vec3 right = { glm::cos(yaw), 0, -glm::sin(yaw) };
+				bool moved = true;
+
+				switch (e.key.keysym.sym)
+				{
+				case SDLK_w: case SDLK_UP: c.origin += forward * move_step; break;
+				case SDLK_s: case SDLK_DOWN: c.origin -= forward * move_step; break;
+				case SDLK_d: case SDLK_RIGHT: c.origin += right * move_step; break;
+				case SDLK_a: case SDLK_LEFT: c.origin -= right * move_step; break;
+				case SDLK_r: c.origin.y += move_step; break;
+				case SDLK_f: c.origin.y -= move_step; break;
+				case SDLK_e: c.orientation.y += turn_step; break;
+				case SDLK_q: c.orientation.y -= turn_step; break;
+				default: moved = false; break;
+				}
+
+				if (moved)
+					render_frame(c);
+			}
+
 			if (e.type == SDL_QUIT)
 				break;
 		}
 	} while (true);
 
-	return 0;
+	recorder.print_report();
+	return allocating_frames > 0 ? 1 : 0;
 }
 
 
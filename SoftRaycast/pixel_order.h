@@ -0,0 +1,122 @@
+#pragma once
+#include <vector>
+#include "glm/vec2.hpp"
+#include "glm/common.hpp"
+
+// Orders in which render_scene visits tiles and the pixels of a tile
+#define ORDER_ROW_MAJOR 0
+// Row-major tiles. Inside a tile, pixels go in packet sized blocks so that
+// rays queued together form 2D blocks instead of row spans
+#define ORDER_TILED 1
+// Z-order (Morton) curve over tiles and over the pixels of a tile
+#define ORDER_MORTON 2
+
+// Spreads the low 16 bits of x to the even bit positions
+unsigned morton_part1by1(unsigned x)
+{
+	x &= 0x0000ffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+unsigned morton_compact1by1(unsigned x)
+{
+	x &= 0x55555555;
+	x = (x | (x >> 1)) & 0x33333333;
+	x = (x | (x >> 2)) & 0x0f0f0f0f;
+	x = (x | (x >> 4)) & 0x00ff00ff;
+	x = (x | (x >> 8)) & 0x0000ffff;
+	return x;
+}
+
+unsigned morton_encode(unsigned x, unsigned y)
+{
+	return morton_part1by1(x) | (morton_part1by1(y) << 1);
+}
+
+glm::ivec2 morton_decode(unsigned code)
+{
+	return { (int) morton_compact1by1(code), (int) morton_compact1by1(code >> 1) };
+}
+
+// Cells of a width x height grid in visiting order. ORDER_TILED walks
+// block_width x block_height blocks in row-major order, row-major inside
+// each block. ORDER_MORTON walks the Z curve of the enclosing power of two
+// square and skips the cells outside the grid.
+void build_grid_order(int order, int width, int height, int block_width, int block_height, std::vector<glm::ivec2>& cells)
+{
+	cells.clear();
+	cells.reserve((size_t) width * height);
+
+	if (order == ORDER_MORTON)
+	{
+		unsigned side = 1;
+		while (side < (unsigned) width || side < (unsigned) height)
+			side *= 2;
+
+		for (unsigned code = 0; code < side * side; code++)
+		{
+			glm::ivec2 cell = morton_decode(code);
+			if (cell.x < width && cell.y < height)
+				cells.push_back(cell);
+		}
+	}
+	else if (order == ORDER_TILED)
+	{
+		for (int by = 0; by < height; by += block_height)
+			for (int bx = 0; bx < width; bx += block_width)
+				for (int y = by; y < glm::min(by + block_height, height); y++)
+					for (int x = bx; x < glm::min(bx + block_width, width); x++)
+						cells.push_back({ x, y });
+	}
+	else
+	{
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+				cells.push_back({ x, y });
+	}
+}
+
+// Visiting orders of one frame, rebuilt only when the canvas, tile size or
+// order changes. Pixel and packet offsets are for a full tile; edge tiles
+// skip the ones that fall outside the canvas.
+struct frame_traversal
+{
+	int order = -1;
+	int canvas_width = 0;
+	int canvas_height = 0;
+	int tile_size = 0;
+
+	int tiles_x = 0;
+	int tiles_y = 0;
+	std::vector<glm::ivec2> tiles;
+	std::vector<glm::ivec2> tile_pixels;
+	// Top left pixel of each packet_width x packet_height block of a tile
+	std::vector<glm::ivec2> tile_packets;
+
+	void prepare(int new_order, int width, int height, int new_tile_size, int packet_width, int packet_height)
+	{
+		if (order == new_order && canvas_width == width && canvas_height == height && tile_size == new_tile_size)
+			return;
+
+		order = new_order;
+		canvas_width = width;
+		canvas_height = height;
+		tile_size = new_tile_size;
+
+		tiles_x = (width + tile_size - 1) / tile_size;
+		tiles_y = (height + tile_size - 1) / tile_size;
+		build_grid_order(order, tiles_x, tiles_y, 1, 1, tiles);
+
+		build_grid_order(order, tile_size, tile_size, packet_width, packet_height, tile_pixels);
+
+		int packets_x = (tile_size + packet_width - 1) / packet_width;
+		int packets_y = (tile_size + packet_height - 1) / packet_height;
+		build_grid_order(order, packets_x, packets_y, 1, 1, tile_packets);
+		for (glm::ivec2& p : tile_packets)
+			p *= glm::ivec2(packet_width, packet_height);
+	}
+};
@@ -6,4 +6,6 @@ struct plane
 	glm::vec3 normal;
 	glm::vec3 point;
 	glm::vec3 color;
+	int specular;
+	float reflective;
 };
\ No newline at end of file
@@ -8,18 +8,18 @@ struct ray
     glm::vec3 direction;
     float t_min, t_max;
 
-    bool t_in_range_exclusive(float t)
+    bool t_in_range_exclusive(float t) const
     {
         return t < t_max && t > t_min;
     }
 
-    bool t_in_range_inclusive(float t)
+    bool t_in_range_inclusive(float t) const
     {
         return t <= t_max && t >= t_min;
     }
 
 
-    glm::vec3 get_point(float t)
+    glm::vec3 get_point(float t) const
     {
         return origin + t * direction;
     }
@@ -0,0 +1,487 @@
+#pragma once
+#include <limits>
+#include <cassert>
+#include "glm/vec3.hpp"
+#include "glm/geometric.hpp"
+#include "geometry_scene.h"
+#include "raytrace.h"
+#include "simd.h"
+
+// Primary rays are traced in PACKET_WIDTH x PACKET_HEIGHT pixel blocks
+// (2x2, 4x2 and 4x4 give 4, 8 and 16 ray packets)
+#define PACKET_WIDTH 4
+#define PACKET_HEIGHT 4
+#define PACKET_SIZE (PACKET_WIDTH * PACKET_HEIGHT)
+// Lane arrays are padded so every SIMD step reads a full register
+#define PACKET_LANES ((PACKET_SIZE + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH)
+
+static_assert(PACKET_LANES <= 32, "packet masks are 32 bit");
+
+// Bundle of rays in structure-of-arrays form. Bit i of active is set when
+// lane i carries a ray. Idle lanes have a zero direction and t_max = -inf,
+// so the SIMD kernels never report a hit for them.
+struct ray_packet
+{
+	float origin_x[PACKET_LANES];
+	float origin_y[PACKET_LANES];
+	float origin_z[PACKET_LANES];
+	float direction_x[PACKET_LANES];
+	float direction_y[PACKET_LANES];
+	float direction_z[PACKET_LANES];
+	float t_min[PACKET_LANES];
+	float t_max[PACKET_LANES];
+	unsigned active;
+
+	void clear()
+	{
+		for (int i = 0; i < PACKET_LANES; i++)
+		{
+			origin_x[i] = origin_y[i] = origin_z[i] = 0;
+			direction_x[i] = direction_y[i] = direction_z[i] = 0;
+			t_min[i] = 0;
+			t_max[i] = -std::numeric_limits<float>::infinity();
+		}
+		active = 0;
+	}
+
+	void set_ray(int lane, const ray& r)
+	{
+		origin_x[lane] = r.origin.x;
+		origin_y[lane] = r.origin.y;
+		origin_z[lane] = r.origin.z;
+		direction_x[lane] = r.direction.x;
+		direction_y[lane] = r.direction.y;
+		direction_z[lane] = r.direction.z;
+		t_min[lane] = r.t_min;
+		t_max[lane] = r.t_max;
+		active |= 1u << lane;
+	}
+
+	ray get_ray(int lane) const
+	{
+		return ray
+		{
+			{ origin_x[lane], origin_y[lane], origin_z[lane] },
+			{ direction_x[lane], direction_y[lane], direction_z[lane] },
+			t_min[lane],
+			t_max[lane]
+		};
+	}
+
+	bool is_active(int lane) const
+	{
+		return (active >> lane) & 1;
+	}
+};
+
+// Roots of every lane of p[lane, lane + SIMD_WIDTH) against sphere s
+simd_roots packet_intersect_sphere(const ray_packet& p, int lane, const sphere_soa& soa, int s)
+{
+	simd_float dx = simd_load(&p.direction_x[lane]);
+	simd_float dy = simd_load(&p.direction_y[lane]);
+	simd_float dz = simd_load(&p.direction_z[lane]);
+
+	simd_float ocx = simd_sub(simd_load(&p.origin_x[lane]), simd_set1(soa.center_x[s]));
+	simd_float ocy = simd_sub(simd_load(&p.origin_y[lane]), simd_set1(soa.center_y[s]));
+	simd_float ocz = simd_sub(simd_load(&p.origin_z[lane]), simd_set1(soa.center_z[s]));
+
+	simd_float a = simd_add(simd_add(simd_mul(dx, dx), simd_mul(dy, dy)), simd_mul(dz, dz));
+	return simd_solve_sphere(ocx, ocy, ocz, dx, dy, dz, a, simd_set1(soa.radius2[s]));
+}
+
+// Roots of every lane against sphere s from its hoisted terms
+simd_roots packet_intersect_hoisted_sphere(const ray_packet& p, int lane, const sphere_origin_soa& hoisted, int s)
+{
+	simd_float dx = simd_load(&p.direction_x[lane]);
+	simd_float dy = simd_load(&p.direction_y[lane]);
+	simd_float dz = simd_load(&p.direction_z[lane]);
+
+	simd_float a = simd_add(simd_add(simd_mul(dx, dx), simd_mul(dy, dy)), simd_mul(dz, dz));
+	return simd_solve_hoisted_sphere(simd_set1(hoisted.oc_x[s]), simd_set1(hoisted.oc_y[s]), simd_set1(hoisted.oc_z[s]), simd_set1(hoisted.c[s]),
+		dx, dy, dz, a);
+}
+
+// Whether every active lane of p can use hoisted (see sphere_origin_soa::serves)
+bool packet_served_by(const ray_packet& p, const sphere_origin_soa& hoisted, const sphere_soa& soa)
+{
+	if (hoisted.padded_count != soa.padded_count || hoisted.padded_count == 0)
+		return false;
+
+	for (int i = 0; i < PACKET_LANES; i++)
+	{
+		if (!p.is_active(i))
+			continue;
+		if (p.origin_x[i] != hoisted.origin.x || p.origin_y[i] != hoisted.origin.y || p.origin_z[i] != hoisted.origin.z || p.t_min[i] < 0)
+			return false;
+	}
+	return true;
+}
+
+// Nearest sphere along every active lane. hit[i] is the sphere index or -1.
+// hoisted, when given, must serve every active lane.
+void packet_closest_sphere(const ray_packet& p, const sphere_soa& soa, float* t, int* hit, const sphere_origin_soa* hoisted = nullptr)
+{
+	for (int lane = 0; lane < PACKET_LANES; lane += SIMD_WIDTH)
+	{
+		simd_float best_t = simd_set1(std::numeric_limits<float>::max());
+		simd_float best_index = simd_set1(-1);
+
+		if ((p.active >> lane) & ((1u << SIMD_WIDTH) - 1))
+		{
+			simd_float t_min = simd_load(&p.t_min[lane]);
+			simd_float t_max = simd_load(&p.t_max[lane]);
+
+			int lanes = (p.active >> lane) & ((1u << SIMD_WIDTH) - 1);
+			STAT_ADD(sphere_tests, (unsigned long long) soa.count * count_bits(lanes));
+
+			for (int s = 0; s < soa.count; s++)
+			{
+				simd_roots roots = hoisted != nullptr ? packet_intersect_hoisted_sphere(p, lane, *hoisted, s) : packet_intersect_sphere(p, lane, soa, s);
+				if (simd_movemask(roots.hit) == 0)
+					continue;
+
+#if RENDER_STATS
+				simd_mask in0 = simd_and(simd_gt(roots.t0, t_min), simd_lt(roots.t0, t_max));
+				simd_mask in1 = simd_and(simd_gt(roots.t1, t_min), simd_lt(roots.t1, t_max));
+				STAT_ADD(sphere_hits, count_bits(simd_movemask(simd_and(roots.hit, simd_or(in0, in1))) & lanes));
+#endif
+
+				simd_float index = simd_set1((float) s);
+
+				simd_mask take0 = simd_and(roots.hit, simd_and(simd_and(simd_gt(roots.t0, t_min), simd_lt(roots.t0, t_max)), simd_lt(roots.t0, best_t)));
+				best_t = simd_select(take0, best_t, roots.t0);
+				best_index = simd_select(take0, best_index, index);
+
+				simd_mask take1 = simd_and(roots.hit, simd_and(simd_and(simd_gt(roots.t1, t_min), simd_lt(roots.t1, t_max)), simd_lt(roots.t1, best_t)));
+				best_t = simd_select(take1, best_t, roots.t1);
+				best_index = simd_select(take1, best_index, index);
+			}
+		}
+
+		float lane_index[SIMD_WIDTH];
+		simd_store(&t[lane], best_t);
+		simd_store(lane_index, best_index);
+		for (int i = 0; i < SIMD_WIDTH; i++)
+			hit[lane + i] = (int) lane_index[i];
+	}
+}
+
+// Bitmask of the active lanes blocked by any sphere inside (t_min, t_max).
+// A SIMD step stops scanning spheres as soon as all of its lanes are blocked.
+// The sphere in *hint (index + 1, as in occluded()) is tested first and is
+// replaced by the last blocker found.
+unsigned packet_occluded(const ray_packet& p, const sphere_soa& soa, int* hint)
+{
+	unsigned occluded = 0;
+	int first = (hint != nullptr && *hint > 0 && *hint <= soa.count) ? *hint - 1 : -1;
+
+	for (int lane = 0; lane < PACKET_LANES; lane += SIMD_WIDTH)
+	{
+		int lanes = (p.active >> lane) & ((1u << SIMD_WIDTH) - 1);
+		if (lanes == 0)
+			continue;
+
+		simd_float t_min = simd_load(&p.t_min[lane]);
+		simd_float t_max = simd_load(&p.t_max[lane]);
+		int blocked = 0;
+
+		// Step -1 stands for the hinted sphere, which the scan then skips
+		for (int step = first < 0 ? 0 : -1; step < soa.count && (blocked & lanes) != lanes; step++)
+		{
+			int s = step < 0 ? first : step;
+			if (step == first)
+				continue;
+
+			simd_roots roots = packet_intersect_sphere(p, lane, soa, s);
+
+			simd_mask in0 = simd_and(simd_gt(roots.t0, t_min), simd_lt(roots.t0, t_max));
+			simd_mask in1 = simd_and(simd_gt(roots.t1, t_min), simd_lt(roots.t1, t_max));
+			int newly_blocked = simd_movemask(simd_and(roots.hit, simd_or(in0, in1))) & lanes & ~blocked;
+			STAT_ADD(sphere_tests, count_bits(lanes & ~blocked));
+			STAT_ADD(sphere_hits, count_bits(newly_blocked));
+
+			if (newly_blocked != 0 && hint != nullptr)
+				*hint = s + 1;
+			blocked |= newly_blocked;
+		}
+
+		occluded |= (unsigned) (blocked & lanes) << lane;
+	}
+
+	return occluded;
+}
+
+// Plane distance of every lane of p[lane, lane + SIMD_WIDTH), in the order of
+// intersect_plane. hit is clear for lanes parallel to the plane.
+simd_float packet_intersect_plane(const ray_packet& p, int lane, const plane& pl, simd_mask& hit)
+{
+	simd_float nx = simd_set1(pl.normal.x);
+	simd_float ny = simd_set1(pl.normal.y);
+	simd_float nz = simd_set1(pl.normal.z);
+
+	simd_float px = simd_sub(simd_set1(pl.point.x), simd_load(&p.origin_x[lane]));
+	simd_float py = simd_sub(simd_set1(pl.point.y), simd_load(&p.origin_y[lane]));
+	simd_float pz = simd_sub(simd_set1(pl.point.z), simd_load(&p.origin_z[lane]));
+
+	simd_float n_dot_pO = simd_add(simd_add(simd_mul(px, nx), simd_mul(py, ny)), simd_mul(pz, nz));
+	simd_float n_dot_dir = simd_add(simd_add(simd_mul(nx, simd_load(&p.direction_x[lane])), simd_mul(ny, simd_load(&p.direction_y[lane]))),
+		simd_mul(nz, simd_load(&p.direction_z[lane])));
+
+	simd_float zero = simd_set1(0);
+	hit = simd_or(simd_lt(n_dot_dir, zero), simd_gt(n_dot_dir, zero));
+	return simd_div(n_dot_pO, n_dot_dir);
+}
+
+// Lowers t to the nearest plane hit of every active lane. plane_hit[i] is the
+// plane index, or -1 when the sphere result in t and hit still stands (a
+// sphere keeps a tie); lanes that hit a plane get hit[i] = -1.
+void packet_closest_plane(const ray_packet& p, std::vector<plane>& planes, float* t, int* hit, int* plane_hit)
+{
+	for (int lane = 0; lane < PACKET_LANES; lane += SIMD_WIDTH)
+	{
+		simd_float best_t = simd_load(&t[lane]);
+		simd_float best_index = simd_set1(-1);
+
+		if ((p.active >> lane) & ((1u << SIMD_WIDTH) - 1))
+		{
+			simd_float t_min = simd_load(&p.t_min[lane]);
+			simd_float t_max = simd_load(&p.t_max[lane]);
+
+			int lanes = (p.active >> lane) & ((1u << SIMD_WIDTH) - 1);
+			STAT_ADD(plane_tests, planes.size() * count_bits(lanes));
+
+			for (int i = 0; i < (int) planes.size(); i++)
+			{
+				simd_mask in_front;
+				simd_float plane_t = packet_intersect_plane(p, lane, planes[i], in_front);
+
+#if RENDER_STATS
+				simd_mask in_range = simd_and(simd_gt(plane_t, t_min), simd_lt(plane_t, t_max));
+				STAT_ADD(plane_hits, count_bits(simd_movemask(simd_and(in_front, in_range)) & lanes));
+#endif
+
+				simd_mask take = simd_and(in_front, simd_and(simd_and(simd_gt(plane_t, t_min), simd_lt(plane_t, t_max)), simd_lt(plane_t, best_t)));
+				best_t = simd_select(take, best_t, plane_t);
+				best_index = simd_select(take, best_index, simd_set1((float) i));
+			}
+		}
+
+		float lane_index[SIMD_WIDTH];
+		simd_store(&t[lane], best_t);
+		simd_store(lane_index, best_index);
+		for (int i = 0; i < SIMD_WIDTH; i++)
+		{
+			plane_hit[lane + i] = (int) lane_index[i];
+			if (plane_hit[lane + i] >= 0)
+				hit[lane + i] = -1;
+		}
+	}
+}
+
+// Bitmask of the active lanes blocked by a plane inside (t_min, t_max)
+unsigned packet_plane_occluded(const ray_packet& p, std::vector<plane>& planes)
+{
+	unsigned occluded = 0;
+
+	for (int lane = 0; lane < PACKET_LANES; lane += SIMD_WIDTH)
+	{
+		int lanes = (p.active >> lane) & ((1u << SIMD_WIDTH) - 1);
+		if (lanes == 0)
+			continue;
+
+		simd_float t_min = simd_load(&p.t_min[lane]);
+		simd_float t_max = simd_load(&p.t_max[lane]);
+		int blocked = 0;
+
+		for (int i = 0; i < (int) planes.size() && (blocked & lanes) != lanes; i++)
+		{
+			simd_mask in_front;
+			simd_float plane_t = packet_intersect_plane(p, lane, planes[i], in_front);
+			int plane_blocked = simd_movemask(simd_and(in_front, simd_and(simd_gt(plane_t, t_min), simd_lt(plane_t, t_max)))) & lanes;
+			STAT_ADD(plane_tests, count_bits(lanes & ~blocked));
+			STAT_ADD(plane_hits, count_bits(plane_blocked & ~blocked));
+			blocked |= plane_blocked;
+		}
+
+		occluded |= (unsigned) (blocked & lanes) << lane;
+	}
+
+	return occluded;
+}
+
+// Closest hits for a packet: sphere index in hit, plane index in plane_hit
+// (-1 for none). Scenes with a BVH walk it once per lane, since the linear
+// packet kernel would be O(spheres) per packet.
+void packet_closest_hit(const ray_packet& p, geometry_scene& scene, float* t, int* hit, int* plane_hit)
+{
+	if (!scene.uses_bvh())
+	{
+		bool hoisted = packet_served_by(p, scene.primary_spheres, scene.sphere_geometry);
+		packet_closest_sphere(p, scene.sphere_geometry, t, hit, hoisted ? &scene.primary_spheres : nullptr);
+	}
+	else
+	{
+		for (int i = 0; i < PACKET_LANES; i++)
+		{
+			soa_hit h = { -1, std::numeric_limits<float>::max() };
+			if (p.is_active(i))
+				h = scene_bvh_closest_hit(scene, p.get_ray(i));
+			t[i] = h.t;
+			hit[i] = h.index;
+		}
+	}
+
+	packet_closest_plane(p, scene.planes, t, hit, plane_hit);
+}
+
+// Lanes of a shadow packet that are blocked before reaching the light.
+// Planes are tested first and the lanes they block skip the sphere scan.
+unsigned packet_shadowed(const ray_packet& p, geometry_scene& scene, int light_index)
+{
+	unsigned plane_blocked = packet_plane_occluded(p, scene.planes);
+	if (plane_blocked == p.active)
+		return plane_blocked;
+
+	if (!scene.uses_bvh())
+	{
+		if (plane_blocked == 0)
+			return packet_occluded(p, scene.sphere_geometry, occluder_hint(light_index));
+
+		ray_packet remaining = p;
+		remaining.active &= ~plane_blocked;
+		return plane_blocked | packet_occluded(remaining, scene.sphere_geometry, occluder_hint(light_index));
+	}
+
+	unsigned blocked = plane_blocked;
+	for (int i = 0; i < PACKET_LANES; i++)
+	{
+		ray r = p.get_ray(i);
+		if (p.is_active(i) && !((blocked >> i) & 1) && occluded(r, scene, light_index))
+			blocked |= 1u << i;
+	}
+	return blocked;
+}
+
+// Packet counterpart of trace_scene_recursive. Lanes that hit different
+// surfaces are shaded independently, and only the lanes that reflect are
+// carried into the next bounce.
+void trace_packet_recursive(const ray_packet& packet, geometry_scene& scene, glm::vec3& back_color, int depth, int max_depth, glm::vec3* colors)
+{
+	assert(scene.sphere_geometry.count == (int) scene.spheres.size());
+
+	float t[PACKET_LANES];
+	int hit[PACKET_LANES];
+	int plane_hit[PACKET_LANES];
+	STAT_ADD(rays[depth == 0 ? STATS_PRIMARY : STATS_REFLECTION][stats_depth(depth)], count_bits(packet.active));
+	packet_closest_hit(packet, scene, t, hit, plane_hit);
+
+	glm::vec3 point[PACKET_LANES];
+	surface surf[PACKET_LANES];
+	glm::vec3 view[PACKET_LANES];
+	float intensity[PACKET_LANES];
+	unsigned shaded = 0;
+
+	for (int i = 0; i < PACKET_LANES; i++)
+	{
+		if (!packet.is_active(i))
+			continue;
+
+		if (hit[i] < 0 && plane_hit[i] < 0)
+		{
+			colors[i] = back_color;
+			STAT_ADD(path_ends[STATS_END_MISS], 1);
+			continue;
+		}
+
+		ray r = packet.get_ray(i);
+		point[i] = r.get_point(t[i]);
+		surf[i] = hit[i] >= 0 ? sphere_surface(scene.spheres[hit[i]], point[i]) : plane_surface(scene.planes[plane_hit[i]], r.direction);
+		view[i] = -r.direction;
+		intensity[i] = 0;
+		shaded |= 1u << i;
+	}
+
+	// One shadow packet per light, built from the lanes that hit something
+	ray_packet shadow;
+	glm::vec3 direction[PACKET_LANES];
+
+	for (light& l : scene.lights)
+	{
+		ALLOC_SCOPE(ALLOC_LIGHTING);
+		int light_index = (int) (&l - scene.lights.data());
+
+		if (l.type == AMBIENT)
+		{
+			for (int i = 0; i < PACKET_LANES; i++)
+				if ((shaded >> i) & 1)
+					intensity[i] += l.intensity;
+			continue;
+		}
+
+		shadow.clear();
+		for (int i = 0; i < PACKET_LANES; i++)
+		{
+			if (!((shaded >> i) & 1))
+				continue;
+
+			ray shadow_ray;
+			light_direction(l, point[i], direction[i], shadow_ray.t_max);
+			shadow_ray.origin = point[i];
+			shadow_ray.t_min = EPSILON;
+			shadow_ray.direction = direction[i];
+			shadow.set_ray(i, shadow_ray);
+		}
+
+		unsigned lit = shaded & ~packet_shadowed(shadow, scene, light_index);
+		STAT_ADD(rays[STATS_SHADOW][stats_depth(depth)], count_bits(shaded));
+		STAT_ADD(light_samples_lit, count_bits(lit));
+		STAT_ADD(light_samples_shadowed, count_bits(shaded & ~lit));
+		for (int i = 0; i < PACKET_LANES; i++)
+			if ((lit >> i) & 1)
+				add_light_contribution(l, direction[i], view[i], surf[i].normal, surf[i].specular, intensity[i]);
+	}
+
+	ray_packet reflected;
+	reflected.clear();
+
+	for (int i = 0; i < PACKET_LANES; i++)
+	{
+		if (!((shaded >> i) & 1))
+			continue;
+
+		colors[i] = surf[i].color * (float) glm::clamp(intensity[i], 0.0f, 1.0f);
+
+		if (depth >= max_depth || surf[i].reflective <= 0)
+		{
+			STAT_ADD(path_ends[surf[i].reflective <= 0 ? STATS_END_NOT_REFLECTIVE : STATS_END_MAX_DEPTH], 1);
+			continue;
+		}
+
+		ray reflect_ray;
+		reflect_ray.origin = point[i];
+		reflect_ray.t_min = EPSILON;
+		reflect_ray.t_max = std::numeric_limits<float>::infinity();
+		reflect_ray.direction = reflect(view[i], surf[i].normal);
+		reflected.set_ray(i, reflect_ray);
+	}
+
+	if (reflected.active == 0)
+		return;
+
+	glm::vec3 reflected_colors[PACKET_LANES];
+	trace_packet_recursive(reflected, scene, back_color, depth + 1, max_depth, reflected_colors);
+
+	for (int i = 0; i < PACKET_LANES; i++)
+	{
+		if (!reflected.is_active(i))
+			continue;
+
+		float& refl = surf[i].reflective;
+		colors[i] = (colors[i] * (1 - refl)) + (reflected_colors[i] * refl);
+	}
+}
+
+void trace_packet(const ray_packet& packet, geometry_scene& scene, glm::vec3& back_color, int max_depth, glm::vec3* colors)
+{
+	trace_packet_recursive(packet, scene, back_color, 0, max_depth, colors);
+}
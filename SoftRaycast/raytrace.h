@@ -3,90 +3,580 @@
 #include "glm/vec2.hpp"
 #include "glm/geometric.hpp"
 #include "glm/exponential.hpp"
+#include "glm/common.hpp"
 #include <vector>
 #include "sphere.h"
 #include "plane.h"
 #include "geometry_scene.h"
 #include "ray.h"
+#include "sphere_soa.h"
+#include "render_stats.h"
+#include "alloc_counter.h"
 #include <cstdio>
+#include <cassert>
 
 #define EPSILON 0.03
+// Cross-checks every accelerated sphere query (SIMD or BVH) against the scalar
+// path with asserts while rendering; --check-simd (simd_check.h) runs the
+// SIMD kernels against it in any build
+#define VALIDATE_SIMD_INTERSECTION 0
+#define SIMD_ULP_TOLERANCE 4
+// Lights that get a last-occluder hint in occluded()
+#define OCCLUDER_CACHE_LIGHTS 16
 
-bool intersect_sphere(ray& r, const sphere& s, std::vector<float>& solutions)
+// Both roots of a ray-sphere intersection, far one first
+struct sphere_roots
+{
+    bool hit;
+    float t0;
+    float t1;
+};
+
+struct plane_root
+{
+    bool hit;
+    float t;
+};
+
+// Closest surface along a ray. At most one of hit_sphere and hit_plane is
+// set, both are nullptr on a miss
+struct hit_record
+{
+    sphere* hit_sphere;
+    float t;
+    plane* hit_plane = nullptr;
+};
+
+// Shading inputs of whatever a ray hit
+struct surface
+{
+    glm::vec3 normal;
+    glm::vec3 color;
+    int specular;
+    float reflective;
+};
+
+sphere_roots intersect_sphere(const ray& r, const sphere& s)
 {
     glm::vec3 oc = r.origin - s.center;
     float a = glm::dot(r.direction, r.direction);
     float b = glm::dot(oc, r.direction) * 2;
-    float c = glm::dot(oc, oc) - glm::pow(s.radius, 2);
+    float c = glm::dot(oc, oc) - s.radius * s.radius;
 
-    float in_sqrt = glm::pow(b, 2) - 4 * a * c;
+    // Plain float products: glm::pow(x, 2) resolves to std::pow(float, int),
+    // which silently evaluates in double and disagrees with the SIMD kernel
+    float in_sqrt = b * b - 4 * a * c;
+    STAT_ADD(sphere_tests, 1);
 
     if (in_sqrt > 0)
     {
-        solutions.push_back((-b + glm::sqrt(in_sqrt)) / (2 * a));
-        solutions.push_back((-b - glm::sqrt(in_sqrt)) / (2 * a));
-        return true;
+        // q has the sign of -b, so neither root subtracts nearly equal
+        // values; the far root is the larger of q / a and c / q
+        float root = glm::sqrt(in_sqrt);
+        float q = -0.5f * (b + (b < 0 ? -root : root));
+        float t0 = glm::max(q / a, c / q);
+        float t1 = glm::min(q / a, c / q);
+        STAT_ADD(sphere_hits, r.t_in_range_exclusive(t0) || r.t_in_range_exclusive(t1));
+        return { true, t0, t1 };
     }
     else
     {
-        return false;
+        return { false, 0, 0 };
     }
 }
 
-bool intersect_plane(ray& r, const plane& plane, float& solution)
+plane_root intersect_plane(const ray& r, const plane& plane)
 {
     float n_dot_pO = glm::dot(plane.point - r.origin, plane.normal);
     float n_dot_dir = glm::dot(plane.normal, r.direction);
+    STAT_ADD(plane_tests, 1);
 
     if (n_dot_dir != 0) // 1 solution
     {
-        solution = n_dot_pO / n_dot_dir;
-        return true;
+        float t = n_dot_pO / n_dot_dir;
+        STAT_ADD(plane_hits, r.t_in_range_exclusive(t));
+        return { true, t };
     }
     else
     {
-        return false;
+        return { false, 0 };
     }
 }
 
+// Replaces closest with the nearest plane inside (t_min, t_max) that is
+// strictly closer, so a sphere keeps a tie
+void closest_plane_intersection(const ray& r, std::vector<plane>& planes, hit_record& closest)
+{
+    for (plane& p : planes)
+    {
+        plane_root root = intersect_plane(r, p);
+        if (root.hit && r.t_in_range_exclusive(root.t) && root.t < closest.t)
+        {
+            closest.hit_sphere = nullptr;
+            closest.hit_plane = &p;
+            closest.t = root.t;
+        }
+    }
+}
+
+bool plane_blocks(const ray& r, const plane& p)
+{
+    plane_root root = intersect_plane(r, p);
+    return root.hit && r.t_in_range_exclusive(root.t);
+}
+
+surface sphere_surface(const sphere& s, const glm::vec3& point)
+{
+    return { glm::normalize(point - s.center), s.color, s.specular, s.reflective };
+}
+
+// Planes are two sided: the normal is turned to face the incoming ray
+surface plane_surface(const plane& p, const glm::vec3& direction)
+{
+    glm::vec3 normal = glm::normalize(p.normal);
+    if (glm::dot(normal, direction) > 0)
+        normal = -normal;
+    return { normal, p.color, p.specular, p.reflective };
+}
+
 
-sphere* closest_sphere_intersection(ray& r, std::vector<sphere>& spheres, float& t)
+hit_record closest_sphere_intersection(ray& r, std::vector<sphere>& spheres)
 {
-    std::vector<float> solutions(2);
-    sphere* closest = nullptr;
-    t = std::numeric_limits<float>::max();
+    hit_record closest = { nullptr, std::numeric_limits<float>::max() };
 
     for (sphere& s : spheres)
     {
-        solutions.clear();
-        if (!intersect_sphere(r, s, solutions)) continue;
+        sphere_roots roots = intersect_sphere(r, s);
+        if (!roots.hit) continue;
+
+        if (r.t_in_range_exclusive(roots.t0) && roots.t0 < closest.t)
+            closest = { &s, roots.t0 };
+
+        if (r.t_in_range_exclusive(roots.t1) && roots.t1 < closest.t)
+            closest = { &s, roots.t1 };
+    }
+
+    return closest;
+}
 
-        for (float sol : solutions)
+// Entry distance of r into the node box, or +inf when it misses the box or
+// only enters it past t_far. The exit distance is padded by a few ulps so
+// rounding never culls a sphere that the quadratic would hit.
+float bvh_box_entry(const bvh_node& node, const ray& r, const glm::vec3& inv_direction, float t_far)
+{
+    glm::vec3 t0 = (node.bounds_min - r.origin) * inv_direction;
+    glm::vec3 t1 = (node.bounds_max - r.origin) * inv_direction;
+    glm::vec3 t_small = glm::min(t0, t1);
+    glm::vec3 t_big = glm::max(t0, t1);
+
+    float t_enter = glm::max(glm::max(t_small.x, t_small.y), glm::max(t_small.z, r.t_min));
+    float t_exit = glm::min(glm::min(t_big.x, t_big.y), glm::min(t_big.z, t_far)) * 1.0000008f;
+
+    return t_enter <= t_exit ? t_enter : std::numeric_limits<float>::infinity();
+}
+
+// Nearest sphere hit inside (t_min, t_max). Ties on t go to the lowest
+// sphere index, so the result matches the linear scans exactly.
+soa_hit bvh_closest_hit(const bvh& tree, const ray& r, const std::vector<sphere>& spheres)
+{
+    soa_hit best = { -1, std::numeric_limits<float>::max() };
+    if (tree.empty())
+        return best;
+
+    glm::vec3 inv_direction = 1.0f / r.direction;
+    int stack[BVH_MAX_DEPTH + 2];
+    int stack_size = 0;
+    int node_index = 0;
+
+    if (bvh_box_entry(tree.nodes[0], r, inv_direction, r.t_max) == std::numeric_limits<float>::infinity())
+        return best;
+
+    while (true)
+    {
+        const bvh_node& node = tree.nodes[node_index];
+
+        if (node.count > 0)
         {
-            glm::vec3 p = r.get_point(sol);
-            if (r.t_in_range_exclusive(sol) && sol < t)
+            for (int i = node.first; i < node.first + node.count; i++)
             {
-                t = sol;
-                closest = &s;
+                int s = tree.indices[i];
+                sphere_roots roots = intersect_sphere(r, spheres[s]);
+                if (!roots.hit)
+                    continue;
+
+                for (float t : { roots.t0, roots.t1 })
+                {
+                    if (r.t_in_range_exclusive(t) && (t < best.t || (t == best.t && s < best.index)))
+                        best = { s, t };
+                }
             }
         }
+        else
+        {
+            float t_far = glm::min(r.t_max, best.t);
+            int near_child = node.first;
+            int far_child = node.first + 1;
+            float near_t = bvh_box_entry(tree.nodes[near_child], r, inv_direction, t_far);
+            float far_t = bvh_box_entry(tree.nodes[far_child], r, inv_direction, t_far);
+
+            if (far_t < near_t)
+            {
+                std::swap(near_child, far_child);
+                std::swap(near_t, far_t);
+            }
+
+            if (near_t != std::numeric_limits<float>::infinity())
+            {
+                if (far_t != std::numeric_limits<float>::infinity())
+                    stack[stack_size++] = far_child;
+                node_index = near_child;
+                continue;
+            }
+        }
+
+        // Pop the next subtree that can still hold a closer hit
+        node_index = -1;
+        while (stack_size > 0 && node_index < 0)
+        {
+            int candidate = stack[--stack_size];
+            if (bvh_box_entry(tree.nodes[candidate], r, inv_direction, glm::min(r.t_max, best.t)) != std::numeric_limits<float>::infinity())
+                node_index = candidate;
+        }
+
+        if (node_index < 0)
+            return best;
+    }
+}
+
+// Index of a sphere that blocks r inside (t_min, t_max), or -1
+int bvh_any_hit(const bvh& tree, const ray& r, const std::vector<sphere>& spheres)
+{
+    if (tree.empty())
+        return -1;
+
+    glm::vec3 inv_direction = 1.0f / r.direction;
+    int stack[BVH_MAX_DEPTH + 2];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0)
+    {
+        const bvh_node& node = tree.nodes[stack[--stack_size]];
+        if (bvh_box_entry(node, r, inv_direction, r.t_max) == std::numeric_limits<float>::infinity())
+            continue;
+
+        if (node.count > 0)
+        {
+            for (int i = node.first; i < node.first + node.count; i++)
+            {
+                int s = tree.indices[i];
+                sphere_roots roots = intersect_sphere(r, spheres[s]);
+                if (roots.hit && (r.t_in_range_exclusive(roots.t0) || r.t_in_range_exclusive(roots.t1)))
+                    return s;
+            }
+        }
+        else
+        {
+            stack[stack_size++] = node.first + 1;
+            stack[stack_size++] = node.first;
+        }
     }
 
+    return -1;
+}
+
+struct wide_bvh_entry
+{
+    int child;
+    int count;
+    float t;
+};
+
+// Near-to-far traversal: the children a node's SIMD box test hits are pushed
+// far-to-near, and entries that start past the best hit are skipped on pop
+soa_hit wide_bvh_closest_hit(const wide_bvh& tree, const ray& r, const std::vector<sphere>& spheres)
+{
+    soa_hit best = { -1, std::numeric_limits<float>::max() };
+    if (tree.empty())
+        return best;
+
+    wide_bvh_ray wr(r);
+    wide_bvh_entry stack[WIDE_BVH_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0, r.t_min };
+
+    while (stack_size > 0)
+    {
+        wide_bvh_entry e = stack[--stack_size];
+        if (e.t > best.t)
+            continue;
+
+        if (e.count > 0)
+        {
+            for (int i = e.child; i < e.child + e.count; i++)
+            {
+                int s = tree.indices[i];
+                sphere_roots roots = intersect_sphere(r, spheres[s]);
+                if (!roots.hit)
+                    continue;
+
+                for (float t : { roots.t0, roots.t1 })
+                {
+                    if (r.t_in_range_exclusive(t) && (t < best.t || (t == best.t && s < best.index)))
+                        best = { s, t };
+                }
+            }
+            continue;
+        }
+
+        const wide_bvh_node& node = tree.nodes[e.child];
+        float t_enter[WIDE_BVH_WIDTH];
+        int mask = wide_bvh_test_children(node, wr, glm::min(r.t_max, best.t), t_enter);
+
+        // Insertion sort of the hit children by decreasing entry distance
+        int order[WIDE_BVH_WIDTH];
+        int hits = 0;
+        for (int c = 0; c < node.child_count; c++)
+        {
+            if (!((mask >> c) & 1))
+                continue;
+
+            int k = hits++;
+            while (k > 0 && t_enter[order[k - 1]] < t_enter[c])
+            {
+                order[k] = order[k - 1];
+                k--;
+            }
+            order[k] = c;
+        }
+
+        for (int k = 0; k < hits; k++)
+            stack[stack_size++] = { node.child[order[k]], node.count[order[k]], t_enter[order[k]] };
+    }
+
+    return best;
+}
+
+// Index of a sphere that blocks r inside (t_min, t_max), or -1
+int wide_bvh_any_hit(const wide_bvh& tree, const ray& r, const std::vector<sphere>& spheres)
+{
+    if (tree.empty())
+        return -1;
+
+    wide_bvh_ray wr(r);
+    wide_bvh_entry stack[WIDE_BVH_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0, r.t_min };
+
+    while (stack_size > 0)
+    {
+        wide_bvh_entry e = stack[--stack_size];
+
+        if (e.count > 0)
+        {
+            for (int i = e.child; i < e.child + e.count; i++)
+            {
+                int s = tree.indices[i];
+                sphere_roots roots = intersect_sphere(r, spheres[s]);
+                if (roots.hit && (r.t_in_range_exclusive(roots.t0) || r.t_in_range_exclusive(roots.t1)))
+                    return s;
+            }
+            continue;
+        }
+
+        const wide_bvh_node& node = tree.nodes[e.child];
+        float t_enter[WIDE_BVH_WIDTH];
+        int mask = wide_bvh_test_children(node, wr, r.t_max, t_enter);
+
+        for (int c = 0; c < node.child_count; c++)
+            if ((mask >> c) & 1)
+                stack[stack_size++] = { node.child[c], node.count[c], t_enter[c] };
+    }
+
+    return -1;
+}
+
+// Closest hit through whichever hierarchy prepare_scene built
+soa_hit scene_bvh_closest_hit(geometry_scene& scene, const ray& r)
+{
+    if (!scene.sphere_wide_bvh.empty())
+        return wide_bvh_closest_hit(scene.sphere_wide_bvh, r, scene.spheres);
+    return bvh_closest_hit(scene.sphere_bvh, r, scene.spheres);
+}
+
+int scene_bvh_any_hit(geometry_scene& scene, const ray& r)
+{
+    if (!scene.sphere_wide_bvh.empty())
+        return wide_bvh_any_hit(scene.sphere_wide_bvh, r, scene.spheres);
+    return bvh_any_hit(scene.sphere_bvh, r, scene.spheres);
+}
+
+// Whether two closest sphere hits of r agree: both miss, or both hit within
+// SIMD_ULP_TOLERANCE ulps or the rounding error of either sphere's roots
+// (another sphere at that distance is accepted). A miss agrees with a
+// grazing hit.
+bool sphere_hits_agree(const ray& r, const std::vector<sphere>& spheres, const soa_hit& x, const soa_hit& y)
+{
+    if (x.index == -1 && y.index == -1)
+        return true;
+    if (x.index == -1 || y.index == -1)
+        return std::isinf(sphere_root_error(r, spheres[x.index == -1 ? y.index : x.index]));
+    if (ulp_distance(x.t, y.t) <= SIMD_ULP_TOLERANCE)
+        return true;
+
+    double error = glm::max(sphere_root_error(r, spheres[x.index]), sphere_root_error(r, spheres[y.index]));
+    return std::abs((double) x.t - y.t) <= SIMD_ULP_TOLERANCE * error;
+}
+
+// Closest hit against every sphere of the scene. Uses the BVH or the SIMD
+// structure-of-arrays kernel once prepare_scene has built them.
+hit_record closest_sphere_intersection(ray& r, geometry_scene& scene)
+{
+    soa_hit closest;
+
+    if (scene.uses_bvh())
+        closest = scene_bvh_closest_hit(scene, r);
+    else if (scene.sphere_geometry.count == (int) scene.spheres.size() && scene.primary_spheres.serves(r, scene.sphere_geometry))
+        closest = closest_sphere_intersection_soa(r, scene.sphere_geometry, &scene.primary_spheres);
+    else if (scene.sphere_geometry.count == (int) scene.spheres.size())
+        closest = closest_sphere_intersection_soa(r, scene.sphere_geometry);
+    else
+        return closest_sphere_intersection(r, scene.spheres);
+
+#if VALIDATE_SIMD_INTERSECTION
+    hit_record scalar = closest_sphere_intersection(r, scene.spheres);
+    soa_hit expected = { scalar.hit_sphere != nullptr ? (int) (scalar.hit_sphere - &scene.spheres[0]) : -1, scalar.t };
+    assert(sphere_hits_agree(r, scene.spheres, closest, expected));
+#endif
+
+    if (closest.index == -1)
+        return { nullptr, closest.t };
+
+    return { &scene.spheres[closest.index], closest.t };
+}
+
+// Closest hit against every sphere and plane of the scene
+hit_record closest_intersection(ray& r, geometry_scene& scene)
+{
+    hit_record closest = closest_sphere_intersection(r, scene);
+    closest_plane_intersection(r, scene.planes, closest);
     return closest;
 }
 
+bool sphere_blocks(const ray& r, const sphere& s)
+{
+    sphere_roots roots = intersect_sphere(r, s);
+    return roots.hit && (r.t_in_range_exclusive(roots.t0) || r.t_in_range_exclusive(roots.t1));
+}
+
+// Last sphere that blocked a shadow ray towards each light on this thread,
+// stored as index + 1 so that 0 means none. Neighbouring pixels are usually
+// shadowed by the same sphere, so it is tested before the full scan.
+thread_local int last_occluder[OCCLUDER_CACHE_LIGHTS];
+
+int* occluder_hint(int light_index)
+{
+    if (light_index < 0 || light_index >= OCCLUDER_CACHE_LIGHTS)
+        return nullptr;
+    return &last_occluder[light_index];
+}
+
+// Any-hit query: true as soon as one sphere or plane blocks r inside
+// (t_min, t_max). light_index picks the last-occluder hint to try first,
+// -1 skips it. Planes are a dot product each, so they go before the spheres.
+bool occluded(ray& r, geometry_scene& scene, int light_index = -1)
+{
+    for (plane& p : scene.planes)
+        if (plane_blocks(r, p))
+            return true;
+
+    int* hint = occluder_hint(light_index);
+    int sphere_count = (int) scene.spheres.size();
+
+    if (hint != nullptr && *hint > 0 && *hint <= sphere_count && sphere_blocks(r, scene.spheres[*hint - 1]))
+        return true;
+
+    int blocker = -1;
+    if (scene.uses_bvh())
+    {
+        blocker = scene_bvh_any_hit(scene, r);
+    }
+    else if (scene.sphere_geometry.count == sphere_count)
+    {
+        blocker = any_sphere_intersection_soa(r, scene.sphere_geometry);
+    }
+    else
+    {
+        for (int i = 0; i < sphere_count && blocker < 0; i++)
+            if (sphere_blocks(r, scene.spheres[i]))
+                blocker = i;
+    }
+
+    if (hint != nullptr && blocker >= 0)
+        *hint = blocker + 1;
+
+    return blocker >= 0;
+}
+
 glm::vec3 reflect(const glm::vec3 &L, const glm::vec3 &normal)
 {
     return (2.0f * normal * glm::dot(normal, L)) - L;
 }
 
-float compute_lighting(geometry_scene & scene, glm::vec3& p, glm::vec3& view, glm::vec3& normal, int specular)
+// Direction from p towards a non ambient light, and the t past which a
+// blocker along it no longer shadows p
+void light_direction(light& l, glm::vec3& p, glm::vec3& direction, float& t_max)
+{
+    if (l.type == POINT)
+    {
+        direction = l.origin - p;
+        // for t = 1, P' = P + direction (P+direction == Plight)
+        t_max = 1;
+    }
+    else
+    {
+        direction = l.direction;
+        // directional lights are always shadowed because they are
+        // infinitely away
+        t_max = std::numeric_limits<float>::infinity();
+    }
+}
+
+// Diffuse and specular terms of an unshadowed light
+void add_light_contribution(light& l, glm::vec3& direction, glm::vec3& view, glm::vec3& normal, int specular, float& intensity)
 {
+    // Diffuse
+    float n_dot_dir = glm::dot(normal, direction);
+    if (n_dot_dir > 0)
+    {
+        float dot_mod = (glm::length(normal) * glm::length(direction));
+        intensity += l.intensity * (n_dot_dir / dot_mod);
+    }
+
+    // Specular
+    if (specular != -1)
+    {
+        glm::vec3 R = reflect(direction, normal);
+        float R_dot_view = glm::dot(R, view);
+        if (R_dot_view > 0)
+        {
+            float length_R_view = glm::length(R) * glm::length(view);
+            float cos_alpha = R_dot_view / length_R_view;
+            intensity += l.intensity * glm::pow(cos_alpha, specular);
+        }
+    }
+}
+
+// depth is the bounce that hit p, for the shadow ray statistics
+float compute_lighting(geometry_scene & scene, glm::vec3& p, glm::vec3& view, glm::vec3& normal, int specular, [[maybe_unused]] int depth = 0)
+{
+    ALLOC_SCOPE(ALLOC_LIGHTING);
     glm::vec3 direction;
     float intensity = 0;
 
     for (light& l : scene.lights)
     {
+        int light_index = (int) (&l - scene.lights.data());
 
         if (l.type == AMBIENT)
         {
@@ -96,51 +586,21 @@ float compute_lighting(geometry_scene & scene, glm::vec3& p, glm::vec3& view, gl
         else
         {
             ray shadow_ray;
-           
-            if (l.type == POINT)
-            {
-                direction = l.origin - p;
-                // for t = 1, P' = P + direction (P+direction == Plight)
-                shadow_ray.t_max = 1;
-            }
-            else
-            {
-                direction = l.direction;
-                // directional lights are always shadowed because they are
-                // infinitely away
-                shadow_ray.t_max = std::numeric_limits<float>::infinity();
-            }
+            light_direction(l, p, direction, shadow_ray.t_max);
 
-            // Compute if p is shadowed by any sphere
+            // Compute if p is shadowed by any plane or sphere
             shadow_ray.origin = p;
             shadow_ray.t_min = EPSILON;
             shadow_ray.direction = direction;
-            float solution;
-            sphere* closest_sphere = closest_sphere_intersection(shadow_ray, scene.spheres, solution);
-            if (closest_sphere != nullptr)
-                continue;
-
-
-            // Diffuse
-            float n_dot_dir = glm::dot(normal, direction);
-            if (n_dot_dir > 0)
+            STAT_ADD(rays[STATS_SHADOW][stats_depth(depth)], 1);
+            if (occluded(shadow_ray, scene, light_index))
             {
-                float dot_mod = (glm::length(normal) * glm::length(direction));
-                intensity += l.intensity * (n_dot_dir / dot_mod);
+                STAT_ADD(light_samples_shadowed, 1);
+                continue;
             }
 
-            // Specular
-            if (specular != -1)
-            {
-                glm::vec3 R = reflect(direction, normal);
-                float R_dot_view = glm::dot(R, view);
-                if (R_dot_view > 0)
-                {
-                    float length_R_view = glm::length(R) * glm::length(view);
-                    float cos_alpha = R_dot_view / length_R_view;
-                    intensity += l.intensity * glm::pow(cos_alpha, specular);
-                }
-            }
+            STAT_ADD(light_samples_lit, 1);
+            add_light_contribution(l, direction, view, normal, specular, intensity);
         }
     }
 
@@ -151,22 +611,29 @@ float compute_lighting(geometry_scene & scene, glm::vec3& p, glm::vec3& view, gl
 
 glm::vec3 trace_scene_recursive(ray& r, geometry_scene& scene, glm::vec3& back_color, int depth, int max_depth)
 {
-    float closest_t;
-    sphere* closest_sphere = closest_sphere_intersection(r, scene.spheres, closest_t);
+    STAT_ADD(rays[depth == 0 ? STATS_PRIMARY : STATS_REFLECTION][stats_depth(depth)], 1);
+    hit_record hit = closest_intersection(r, scene);
 
-    if (closest_sphere == nullptr)
+    if (hit.hit_sphere == nullptr && hit.hit_plane == nullptr)
+    {
+        STAT_ADD(path_ends[STATS_END_MISS], 1);
         return back_color;
+    }
 
-    glm::vec3 point = r.get_point(closest_t);
-    glm::vec3 normal = glm::normalize(point - closest_sphere->center);
+    glm::vec3 point = r.get_point(hit.t);
+    surface surf = hit.hit_sphere != nullptr ? sphere_surface(*hit.hit_sphere, point) : plane_surface(*hit.hit_plane, r.direction);
+    glm::vec3& normal = surf.normal;
     glm::vec3 view = -r.direction;
 
-    float intensity = compute_lighting(scene, point, view, normal, closest_sphere->specular);
-    glm::vec3 color = closest_sphere->color * (float) glm::clamp(intensity, 0.0f, 1.0f);
+    float intensity = compute_lighting(scene, point, view, normal, surf.specular, depth);
+    glm::vec3 color = surf.color * (float) glm::clamp(intensity, 0.0f, 1.0f);
 
-    float& refl = closest_sphere->reflective;
+    float& refl = surf.reflective;
     if (depth >= max_depth || refl <= 0)
+    {
+        STAT_ADD(path_ends[refl <= 0 ? STATS_END_NOT_REFLECTIVE : STATS_END_MAX_DEPTH], 1);
         return color;
+    }
 
     ray reflect_ray;
     reflect_ray.origin = point;
@@ -0,0 +1,493 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include "glm/vec2.hpp"
+#include "glm/vec3.hpp"
+#include "scene_generator.h"
+
+// How per-frame render statistics are printed (render_stats.h)
+enum stats_output
+{
+	STATS_OUTPUT_OFF,
+	STATS_OUTPUT_TEXT,
+	STATS_OUTPUT_JSON
+};
+
+// Everything that used to need a rebuild to change. Filled from the command
+// line (--key value, --key=value, or a bare --flag for booleans) and from
+// config files of "key = value" lines (# starts a comment), in the order
+// they are given, so later values win.
+struct render_settings
+{
+	int screen_width = 1920;
+	int screen_height = 1080;
+	// 0 means the screen size
+	int canvas_width = 0;
+	int canvas_height = 0;
+	int reflection_max_depth = 2;
+	// Threads of the job system, 0 means one per hardware thread
+	int render_threads = 0;
+	// The main thread runs jobs while it waits instead of sleeping (job_system.h)
+	bool main_thread_jobs = true;
+	bool generate_screenshot = true;
+	bool shutdown_after_render = false;
+	// Renders without SDL video, a window or a renderer and exits once the
+	// images are written
+	bool headless = false;
+	int stats = STATS_OUTPUT_OFF;
+	// Chrome trace_event file of the run's timing zones (timeline.h), and
+	// room for how many events
+	std::string timeline_json;
+	int timeline_events = 1 << 18;
+	// Per-pixel cost image saved next to each frame, a heatmap_metric
+	int heatmap = 0;
+	// Times the raytrace.h kernels (kernel_bench.h) instead of rendering
+	bool bench_kernels = false;
+	// Compares the SIMD sphere kernels with the scalar scan (simd_check.h)
+	// instead of rendering
+	bool check_simd = false;
+	// perf_event_open counters for the kernel benchmarks and each frame's
+	// trace and linearize work (hw_counters.h), and a raw SIMD event
+	bool hw_counters = false;
+	unsigned long long hw_simd_event = 0;
+	// Heap allocations of each frame by subsystem (alloc_counter.h), in
+	// builds with COUNT_ALLOCATIONS
+	bool allocs = false;
+
+	// Golden image regression check (run_regression in main.cpp)
+	bool regress = false;
+	bool update_golden = false;
+	std::string golden_dir = "golden";
+	// Largest per channel difference still accepted
+	int regress_tolerance = 1;
+	// Fails when throughput is this fraction below the history baseline
+	float regress_threshold = 0.1f;
+	int regress_frames = 10;
+
+	// Parameter sweep, run instead of the animation when sweep_csv is set
+	std::string sweep_csv;
+	std::vector<glm::ivec2> sweep_resolutions;
+	std::vector<int> sweep_depths;
+	std::vector<int> sweep_threads;
+	int sweep_frames = 3;
+	// Sphere and per-type light counts to sweep, generated scenes only
+	std::vector<int> sweep_spheres;
+	std::vector<int> sweep_lights;
+
+	// Generated scene used instead of the demo one unless layout is SCENE_DEMO
+	scene_params scene;
+
+	// Starting camera, orientation as Euler angles in radians. Setting either
+	// one holds the camera there instead of running the animation.
+	glm::vec3 camera_origin = glm::vec3(0);
+	glm::vec3 camera_orientation = glm::vec3(0);
+	bool camera_set = false;
+
+	// Frames slower than this (0 = never) are written to slow_frame_dir as a
+	// config file that renders them again (frame_timing.h)
+	float frame_budget_ms = 0;
+	std::string slow_frame_dir = "slow_frames";
+
+	int canvas_w() const
+	{
+		return canvas_width > 0 ? canvas_width : screen_width;
+	}
+
+	int canvas_h() const
+	{
+		return canvas_height > 0 ? canvas_height : screen_height;
+	}
+};
+
+bool parse_int(const std::string& text, int& value)
+{
+	char* end = nullptr;
+	errno = 0;
+	long parsed = strtol(text.c_str(), &end, 10);
+	if (text.empty() || *end != '\0' || errno == ERANGE || parsed < INT_MIN || parsed > INT_MAX)
+		return false;
+	value = (int) parsed;
+	return true;
+}
+
+bool parse_float(const std::string& text, float& value)
+{
+	char* end = nullptr;
+	errno = 0;
+	float parsed = strtof(text.c_str(), &end);
+	if (text.empty() || *end != '\0' || errno == ERANGE)
+		return false;
+	value = parsed;
+	return true;
+}
+
+// Decimal, or hexadecimal with 0x
+bool parse_hex(const std::string& text, unsigned long long& value)
+{
+	char* end = nullptr;
+	unsigned long long parsed = strtoull(text.c_str(), &end, 0);
+	if (text.empty() || *end != '\0')
+		return false;
+	value = parsed;
+	return true;
+}
+
+bool parse_bool(const std::string& text, bool& value)
+{
+	if (text == "1" || text == "true" || text == "on" || text == "yes")
+		value = true;
+	else if (text == "0" || text == "false" || text == "off" || text == "no")
+		value = false;
+	else
+		return false;
+	return true;
+}
+
+std::vector<std::string> split_list(const std::string& text)
+{
+	std::vector<std::string> items;
+	size_t begin = 0;
+	while (begin <= text.size())
+	{
+		size_t end = text.find(',', begin);
+		if (end == std::string::npos)
+			end = text.size();
+		if (end > begin)
+			items.push_back(text.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	return items;
+}
+
+// Every value has to be at least minimum
+bool parse_int_list(const std::string& text, std::vector<int>& values, int minimum)
+{
+	values.clear();
+	for (const std::string& item : split_list(text))
+	{
+		int value;
+		if (!parse_int(item, value) || value < minimum)
+			return false;
+		values.push_back(value);
+	}
+	return !values.empty();
+}
+
+// "1280x720,1920x1080"
+bool parse_resolution_list(const std::string& text, std::vector<glm::ivec2>& values)
+{
+	values.clear();
+	for (const std::string& item : split_list(text))
+	{
+		size_t x = item.find('x');
+		glm::ivec2 resolution;
+		if (x == std::string::npos || !parse_int(item.substr(0, x), resolution.x) || !parse_int(item.substr(x + 1), resolution.y)
+			|| resolution.x <= 0 || resolution.y <= 0)
+			return false;
+		values.push_back(resolution);
+	}
+	return !values.empty();
+}
+
+// "x,y,z"
+bool parse_vec3(const std::string& text, glm::vec3& value)
+{
+	std::vector<std::string> items = split_list(text);
+	return items.size() == 3 && parse_float(items[0], value.x) && parse_float(items[1], value.y) && parse_float(items[2], value.z);
+}
+
+bool parse_stats_output(const std::string& text, int& value)
+{
+	if (text == "off")
+		value = STATS_OUTPUT_OFF;
+	else if (text == "text")
+		value = STATS_OUTPUT_TEXT;
+	else if (text == "json")
+		value = STATS_OUTPUT_JSON;
+	else
+		return false;
+	return true;
+}
+
+// Values of heatmap_metric (cost_heatmap.h)
+bool parse_heatmap_metric(const std::string& text, int& value)
+{
+	static const char* names[] = { "off", "cycles", "rays", "tests" };
+	for (int i = 0; i < 4; i++)
+	{
+		if (text == names[i])
+		{
+			value = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool load_settings_file(render_settings& settings, const char* path);
+
+// Applies one key. Returns false (after printing why) for unknown keys and
+// bad values
+bool apply_setting(render_settings& settings, const std::string& key, const std::string& value)
+{
+	bool ok;
+
+	if (key == "width")
+		ok = parse_int(value, settings.screen_width) && settings.screen_width > 0;
+	else if (key == "height")
+		ok = parse_int(value, settings.screen_height) && settings.screen_height > 0;
+	else if (key == "canvas-width")
+		ok = parse_int(value, settings.canvas_width) && settings.canvas_width >= 0;
+	else if (key == "canvas-height")
+		ok = parse_int(value, settings.canvas_height) && settings.canvas_height >= 0;
+	else if (key == "depth")
+		ok = parse_int(value, settings.reflection_max_depth) && settings.reflection_max_depth >= 0;
+	else if (key == "threads")
+		ok = parse_int(value, settings.render_threads) && settings.render_threads >= 0;
+	else if (key == "main-thread-jobs")
+		ok = parse_bool(value, settings.main_thread_jobs);
+	else if (key == "screenshot")
+		ok = parse_bool(value, settings.generate_screenshot);
+	else if (key == "shutdown")
+		ok = parse_bool(value, settings.shutdown_after_render);
+	else if (key == "headless")
+		ok = parse_bool(value, settings.headless);
+	else if (key == "stats")
+		ok = parse_stats_output(value, settings.stats);
+	else if (key == "bench-kernels")
+		ok = parse_bool(value, settings.bench_kernels);
+	else if (key == "check-simd")
+		ok = parse_bool(value, settings.check_simd);
+	else if (key == "hw-counters")
+		ok = parse_bool(value, settings.hw_counters);
+	else if (key == "hw-simd-event")
+		ok = parse_hex(value, settings.hw_simd_event);
+	else if (key == "allocs")
+		ok = parse_bool(value, settings.allocs);
+	else if (key == "regress")
+		ok = parse_bool(value, settings.regress);
+	else if (key == "update-golden")
+		ok = parse_bool(value, settings.update_golden);
+	else if (key == "golden-dir")
+		ok = !(settings.golden_dir = value).empty();
+	else if (key == "regress-tolerance")
+		ok = parse_int(value, settings.regress_tolerance) && settings.regress_tolerance >= 0;
+	else if (key == "regress-threshold")
+		ok = parse_float(value, settings.regress_threshold) && settings.regress_threshold >= 0;
+	else if (key == "regress-frames")
+		ok = parse_int(value, settings.regress_frames) && settings.regress_frames > 0;
+	else if (key == "heatmap")
+		ok = parse_heatmap_metric(value, settings.heatmap);
+	else if (key == "timeline")
+		ok = !(settings.timeline_json = value).empty();
+	else if (key == "timeline-events")
+		ok = parse_int(value, settings.timeline_events) && settings.timeline_events > 0;
+	else if (key == "sweep")
+		ok = !(settings.sweep_csv = value).empty();
+	else if (key == "sweep-resolutions")
+		ok = parse_resolution_list(value, settings.sweep_resolutions);
+	else if (key == "sweep-depths")
+		ok = parse_int_list(value, settings.sweep_depths, 0);
+	else if (key == "sweep-threads")
+		ok = parse_int_list(value, settings.sweep_threads, 0);
+	else if (key == "sweep-frames")
+		ok = parse_int(value, settings.sweep_frames) && settings.sweep_frames > 0;
+	else if (key == "sweep-spheres")
+		ok = parse_int_list(value, settings.sweep_spheres, 1);
+	else if (key == "sweep-lights")
+		ok = parse_int_list(value, settings.sweep_lights, 0);
+	else if (key == "scene")
+		ok = parse_scene_layout(value, settings.scene.layout);
+	else if (key == "seed")
+		ok = parse_int(value, settings.scene.seed) && settings.scene.seed >= 0;
+	else if (key == "spheres")
+		ok = parse_int(value, settings.scene.spheres) && settings.scene.spheres >= 0;
+	else if (key == "lights")
+		ok = parse_int(value, settings.scene.lights) && settings.scene.lights >= 0;
+	else if (key == "reflective")
+		ok = parse_float(value, settings.scene.reflective_fraction) && settings.scene.reflective_fraction >= 0 && settings.scene.reflective_fraction <= 1;
+	else if (key == "ground")
+		ok = parse_bool(value, settings.scene.ground);
+	else if (key == "camera-origin")
+		ok = settings.camera_set = parse_vec3(value, settings.camera_origin);
+	else if (key == "camera-orientation")
+		ok = settings.camera_set = parse_vec3(value, settings.camera_orientation);
+	else if (key == "frame-budget")
+		ok = parse_float(value, settings.frame_budget_ms) && settings.frame_budget_ms >= 0;
+	else if (key == "slow-frame-dir")
+		ok = !(settings.slow_frame_dir = value).empty();
+	else if (key == "config")
+		return load_settings_file(settings, value.c_str());
+	else
+	{
+		printf("Unknown setting '%s'\n", key.c_str());
+		return false;
+	}
+
+	if (!ok)
+		printf("Bad value '%s' for setting '%s'\n", value.c_str(), key.c_str());
+	return ok;
+}
+
+bool is_bool_setting(const std::string& key)
+{
+	return key == "screenshot" || key == "shutdown" || key == "headless" || key == "bench-kernels" || key == "check-simd" || key == "regress"
+		|| key == "update-golden" || key == "hw-counters" || key == "allocs" || key == "main-thread-jobs";
+}
+
+std::string trim(const std::string& text)
+{
+	size_t begin = text.find_first_not_of(" \t\r\n");
+	if (begin == std::string::npos)
+		return "";
+	size_t end = text.find_last_not_of(" \t\r\n");
+	return text.substr(begin, end - begin + 1);
+}
+
+bool load_settings_file(render_settings& settings, const char* path)
+{
+	// Files being read, outermost first. A config that includes itself,
+	// directly or through another one, would recurse until the stack overflows.
+	static std::vector<std::string> open_files;
+	std::error_code error;
+	std::string identity = std::filesystem::weakly_canonical(path, error).string();
+	if (error)
+		identity = path;
+
+	if (std::find(open_files.begin(), open_files.end(), identity) != open_files.end())
+	{
+		printf("Config file '%s' includes itself\n", path);
+		return false;
+	}
+
+	std::ifstream file(path);
+	if (!file)
+	{
+		printf("Cannot open config file '%s'\n", path);
+		return false;
+	}
+
+	open_files.push_back(identity);
+	bool ok = true;
+	std::string text;
+	for (int line_number = 1; std::getline(file, text); line_number++)
+	{
+		size_t comment = text.find('#');
+		if (comment != std::string::npos)
+			text.resize(comment);
+
+		text = trim(text);
+		if (text.empty())
+			continue;
+
+		size_t equals = text.find('=');
+		std::string key = trim(text.substr(0, equals));
+		std::string value = equals == std::string::npos ? "1" : trim(text.substr(equals + 1));
+
+		if (equals == std::string::npos && !is_bool_setting(key))
+		{
+			printf("%s:%d: expected key = value\n", path, line_number);
+			ok = false;
+			continue;
+		}
+
+		if (!apply_setting(settings, key, value))
+		{
+			printf("%s:%d: ignored\n", path, line_number);
+			ok = false;
+		}
+	}
+
+	open_files.pop_back();
+	return ok;
+}
+
+bool parse_settings(render_settings& settings, int argc, char** argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg.compare(0, 2, "--") != 0)
+		{
+			printf("Unexpected argument '%s'\n", argv[i]);
+			return false;
+		}
+
+		std::string key = arg.substr(2);
+		std::string value;
+		size_t equals = key.find('=');
+
+		if (equals != std::string::npos)
+		{
+			value = key.substr(equals + 1);
+			key.resize(equals);
+		}
+		else if (is_bool_setting(key) && (i + 1 >= argc || strncmp(argv[i + 1], "--", 2) == 0))
+		{
+			value = "1";
+		}
+		else if (i + 1 < argc)
+		{
+			value = argv[++i];
+		}
+		else
+		{
+			// Reports an unknown key, or the missing value of a known one
+			apply_setting(settings, key, "");
+			return false;
+		}
+
+		if (!apply_setting(settings, key, value))
+			return false;
+	}
+
+	return true;
+}
+
+void print_settings_usage()
+{
+	printf(
+		"Settings, as --key value on the command line or key = value in a --config file:\n"
+		"  width, height                 window size (1920x1080)\n"
+		"  canvas-width, canvas-height   traced image size, 0 = window size\n"
+		"  depth                         reflection depth (2)\n"
+		"  threads                       render threads, 0 = one per hardware thread\n"
+		"  main-thread-jobs              main thread runs jobs too, otherwise one more worker (on)\n"
+		"  screenshot, shutdown, headless\n"
+		"  stats                         per frame counters: off, text or json (off), RENDER_STATS builds\n"
+		"  heatmap                       per pixel cost image: off, cycles, rays or tests (off)\n"
+		"  timeline                      Chrome trace JSON file of frames, tiles and stages\n"
+		"  timeline-events               events the timeline can hold (262144)\n"
+		"  bench-kernels                 time the ray tracing kernels and exit\n"
+		"  check-simd                    compare the SIMD sphere kernels with the scalar scan and exit\n"
+		"  hw-counters                   hardware counters per frame and benchmark (Linux)\n"
+		"  hw-simd-event                 raw perf event counted as SIMD instructions, e.g. 0x28c7\n"
+		"  allocs                        heap allocations per frame and subsystem (COUNT_ALLOCATIONS builds)\n"
+		"  regress, update-golden        check the reference scenes against golden images, or rewrite them\n"
+		"  golden-dir                    golden images and history.jsonl (golden)\n"
+		"  regress-tolerance             accepted difference per channel from the golden and scalar frames (1)\n"
+		"  regress-threshold             accepted throughput drop below the baseline (0.1)\n"
+		"  regress-frames                timed frames per scene (10)\n"
+		"  config                        file to read more settings from\n"
+		"  sweep                         CSV file; renders every combination of\n"
+		"  sweep-resolutions             e.g. 1280x720,1920x1080\n"
+		"  sweep-depths                  e.g. 0,1,2,4\n"
+		"  sweep-threads                 e.g. 1,2,4\n"
+		"  sweep-frames                  timed frames per combination (3)\n"
+		"  sweep-spheres, sweep-lights   e.g. 16,64,256,1024; generated scenes only\n"
+		"  scene                         demo, uniform, clustered or stacked (demo)\n"
+		"  seed, spheres, lights         generated scene seed (1), spheres (256), lights per type (1)\n"
+		"  reflective, ground            share of reflective spheres (0.3), ground plane (on)\n"
+		"  camera-origin                 fixed camera position x,y,z instead of the animation\n"
+		"  camera-orientation            fixed camera Euler angles x,y,z in radians\n"
+		"  frame-budget                  ms; slower frames are logged as replayable configs (0 = off)\n"
+		"  slow-frame-dir                where slow frames are logged (slow_frames)\n");
+}
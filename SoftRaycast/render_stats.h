@@ -0,0 +1,224 @@
+#pragma once
+#include <atomic>
+#include <cstdio>
+#include <string>
+
+// Counts rays, intersection tests, light samples and reflection endings.
+// Off by default, since counting costs the hot loops a few percent; build
+// with RENDER_STATS=1 for the stats setting and the ray and test heatmaps.
+// When 0 every STAT_ADD compiles to nothing.
+#ifndef RENDER_STATS
+#define RENDER_STATS 0
+#endif
+// Depth levels counted separately, deeper rays share the last one
+#define STATS_DEPTHS 8
+// Threads that can count at once. A shard goes back to the pool when its
+// thread exits; counts of threads beyond this are dropped.
+#define STATS_MAX_THREADS 64
+
+enum stats_ray_kind
+{
+	STATS_PRIMARY,
+	STATS_SHADOW,
+	STATS_REFLECTION,
+	STATS_RAY_KINDS
+};
+
+// Why a path stopped bouncing
+enum stats_path_end
+{
+	STATS_END_MISS,
+	STATS_END_NOT_REFLECTIVE,
+	STATS_END_MAX_DEPTH,
+	STATS_PATH_ENDS
+};
+
+struct render_stats
+{
+	unsigned long long rays[STATS_RAY_KINDS][STATS_DEPTHS];
+	unsigned long long sphere_tests;
+	unsigned long long sphere_hits;
+	unsigned long long plane_tests;
+	unsigned long long plane_hits;
+	unsigned long long light_samples_lit;
+	unsigned long long light_samples_shadowed;
+	unsigned long long path_ends[STATS_PATH_ENDS];
+
+	void clear()
+	{
+		*this = render_stats();
+	}
+
+	void add(const render_stats& other)
+	{
+		for (int k = 0; k < STATS_RAY_KINDS; k++)
+			for (int d = 0; d < STATS_DEPTHS; d++)
+				rays[k][d] += other.rays[k][d];
+
+		sphere_tests += other.sphere_tests;
+		sphere_hits += other.sphere_hits;
+		plane_tests += other.plane_tests;
+		plane_hits += other.plane_hits;
+		light_samples_lit += other.light_samples_lit;
+		light_samples_shadowed += other.light_samples_shadowed;
+
+		for (int e = 0; e < STATS_PATH_ENDS; e++)
+			path_ends[e] += other.path_ends[e];
+	}
+
+	unsigned long long ray_total(int kind) const
+	{
+		unsigned long long total = 0;
+		for (int d = 0; d < STATS_DEPTHS; d++)
+			total += rays[kind][d];
+		return total;
+	}
+
+	unsigned long long ray_total() const
+	{
+		return ray_total(STATS_PRIMARY) + ray_total(STATS_SHADOW) + ray_total(STATS_REFLECTION);
+	}
+};
+
+int stats_depth(int depth)
+{
+	return depth < STATS_DEPTHS ? depth : STATS_DEPTHS - 1;
+}
+
+int count_bits(unsigned mask)
+{
+	int count = 0;
+	for (; mask != 0; mask &= mask - 1)
+		count++;
+	return count;
+}
+
+#if RENDER_STATS
+
+// One shard per thread on its own cache lines, so counting never shares a
+// line between threads. Shards are only merged while no frame is tracing.
+struct alignas(64) render_stats_shard
+{
+	render_stats stats;
+};
+
+render_stats_shard stats_shards[STATS_MAX_THREADS];
+std::atomic<bool> stats_shard_taken[STATS_MAX_THREADS];
+std::atomic<bool> stats_overflow_reported{ false };
+thread_local render_stats* thread_stats = nullptr;
+// Counts of a thread that found no free shard, never collected
+thread_local render_stats stats_overflow;
+
+// Gives the thread's shard back when the thread exits. Its counts stay in
+// the shard until the next collect_render_stats.
+struct stats_shard_owner
+{
+	int shard = -1;
+
+	~stats_shard_owner()
+	{
+		if (shard >= 0)
+			stats_shard_taken[shard].store(false, std::memory_order_release);
+	}
+};
+
+thread_local stats_shard_owner stats_owner;
+
+render_stats& local_render_stats()
+{
+	if (thread_stats == nullptr)
+	{
+		for (int i = 0; i < STATS_MAX_THREADS && thread_stats == nullptr; i++)
+		{
+			bool expected = false;
+			if (stats_shard_taken[i].compare_exchange_strong(expected, true, std::memory_order_acquire))
+			{
+				stats_owner.shard = i;
+				thread_stats = &stats_shards[i].stats;
+			}
+		}
+
+		if (thread_stats == nullptr)
+		{
+			if (!stats_overflow_reported.exchange(true))
+				printf("More than %d threads counting, stats leave the rest out\n", STATS_MAX_THREADS);
+			thread_stats = &stats_overflow;
+		}
+	}
+	return *thread_stats;
+}
+
+#define STAT_ADD(field, n) (local_render_stats().field += (n))
+
+#else
+
+// n stays an unevaluated operand, so values computed only for it still count as used
+#define STAT_ADD(field, n) ((void) sizeof(n))
+
+#endif
+
+// Sums every thread's counters into total and resets them. Call between
+// frames, never while tracing
+void collect_render_stats(render_stats& total)
+{
+	total.clear();
+#if RENDER_STATS
+	for (int i = 0; i < STATS_MAX_THREADS; i++)
+	{
+		total.add(stats_shards[i].stats);
+		stats_shards[i].stats.clear();
+	}
+#endif
+}
+
+double stats_ratio(unsigned long long part, unsigned long long whole)
+{
+	return whole > 0 ? (double) part / whole : 0;
+}
+
+void print_render_stats_text([[maybe_unused]] const render_stats& s, [[maybe_unused]] int frame)
+{
+#if RENDER_STATS
+	static const char* kind_names[STATS_RAY_KINDS] = { "primary", "shadow", "reflection" };
+
+	printf("Frame %d stats: %llu rays\n", frame, s.ray_total());
+	for (int k = 0; k < STATS_RAY_KINDS; k++)
+	{
+		printf("  %-10s %12llu  by depth:", kind_names[k], s.ray_total(k));
+		for (int d = 0; d < STATS_DEPTHS; d++)
+			printf(" %llu", s.rays[k][d]);
+		printf("\n");
+	}
+	printf("  sphere tests %llu, hits %llu (%.1f%%)\n", s.sphere_tests, s.sphere_hits, 100 * stats_ratio(s.sphere_hits, s.sphere_tests));
+	printf("  plane tests %llu, hits %llu (%.1f%%)\n", s.plane_tests, s.plane_hits, 100 * stats_ratio(s.plane_hits, s.plane_tests));
+	printf("  light samples lit %llu, shadowed %llu (%.1f%% shadowed)\n", s.light_samples_lit, s.light_samples_shadowed,
+		100 * stats_ratio(s.light_samples_shadowed, s.light_samples_lit + s.light_samples_shadowed));
+	printf("  paths ended by miss %llu, non reflective surface %llu, max depth %llu\n",
+		s.path_ends[STATS_END_MISS], s.path_ends[STATS_END_NOT_REFLECTIVE], s.path_ends[STATS_END_MAX_DEPTH]);
+#endif
+}
+
+std::string render_stats_json(const render_stats& s, int frame, double frame_ms)
+{
+	static const char* kind_names[STATS_RAY_KINDS] = { "primary", "shadow", "reflection" };
+	std::string json = "{\"frame\":" + std::to_string(frame) + ",\"ms\":" + std::to_string(frame_ms) + ",\"rays\":{";
+
+	for (int k = 0; k < STATS_RAY_KINDS; k++)
+	{
+		json += std::string(k ? "," : "") + "\"" + kind_names[k] + "\":[";
+		for (int d = 0; d < STATS_DEPTHS; d++)
+			json += (d ? "," : "") + std::to_string(s.rays[k][d]);
+		json += "]";
+	}
+
+	json += "},\"sphere_tests\":" + std::to_string(s.sphere_tests) +
+		",\"sphere_hits\":" + std::to_string(s.sphere_hits) +
+		",\"plane_tests\":" + std::to_string(s.plane_tests) +
+		",\"plane_hits\":" + std::to_string(s.plane_hits) +
+		",\"light_samples_lit\":" + std::to_string(s.light_samples_lit) +
+		",\"light_samples_shadowed\":" + std::to_string(s.light_samples_shadowed) +
+		",\"path_ends\":{\"miss\":" + std::to_string(s.path_ends[STATS_END_MISS]) +
+		",\"not_reflective\":" + std::to_string(s.path_ends[STATS_END_NOT_REFLECTIVE]) +
+		",\"max_depth\":" + std::to_string(s.path_ends[STATS_END_MAX_DEPTH]) + "}}";
+	return json;
+}
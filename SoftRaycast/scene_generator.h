@@ -0,0 +1,164 @@
+#pragma once
+#include <random>
+#include <vector>
+#include <string>
+#include <cmath>
+#include "glm/vec3.hpp"
+#include "glm/geometric.hpp"
+#include "glm/common.hpp"
+#include "geometry_scene.h"
+#include "alloc_counter.h"
+
+// Where generate_scene puts its spheres. SCENE_DEMO is the hand-built scene
+// in main and is not generated.
+enum scene_layout
+{
+	SCENE_DEMO,
+	// Spread evenly through the view frustum
+	SCENE_UNIFORM,
+	// Tight groups of about 64 spheres, leaving most of the frustum empty
+	SCENE_CLUSTERED,
+	// A column along the view axis, so most rays pass near every sphere
+	SCENE_STACKED
+};
+
+const char* scene_layout_name(int layout)
+{
+	static const char* names[] = { "demo", "uniform", "clustered", "stacked" };
+	return names[layout];
+}
+
+bool parse_scene_layout(const std::string& text, int& value)
+{
+	for (int i = SCENE_DEMO; i <= SCENE_STACKED; i++)
+	{
+		if (text == scene_layout_name(i))
+		{
+			value = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+struct scene_params
+{
+	int layout = SCENE_DEMO;
+	int seed = 1;
+	int spheres = 256;
+	// Lights of each LightType
+	int lights = 1;
+	// Share of spheres with a reflective material
+	float reflective_fraction = 0.3f;
+	bool ground = true;
+};
+
+// Draws from the raw engine output. std::mt19937 is specified bit for bit,
+// but the std distributions are not, so they would give each standard
+// library its own scene for the same seed.
+
+// Uniform in [0, 1) from the top 24 bits, exactly representable as a float
+float rng_unit(std::mt19937& rng)
+{
+	return (rng() >> 8) * 0x1p-24f;
+}
+
+float rng_uniform(std::mt19937& rng, float lo, float hi)
+{
+	return lo + (hi - lo) * rng_unit(rng);
+}
+
+// Uniform in [0, count)
+int rng_index(std::mt19937& rng, int count)
+{
+	return (int) (((unsigned long long) rng() * (unsigned) count) >> 32);
+}
+
+// Standard normal by Box-Muller, one of the pair per call. Evaluated in
+// double so that libm differences stay far below float precision.
+float rng_gaussian(std::mt19937& rng)
+{
+	double u1 = 1.0 - rng_unit(rng);
+	double u2 = rng_unit(rng);
+	return (float) (std::sqrt(-2 * std::log(u1)) * std::cos(6.283185307179586 * u2));
+}
+
+// Fills scene with a pseudo random scene in front of the default camera
+// (origin, looking down +z). The same params always give the same scene.
+// Sphere radii shrink with the cube root of the count, so the share of the
+// volume they fill, and with it how much they occlude, stays about the same
+// as the count grows. Call prepare_scene afterwards.
+void generate_scene(geometry_scene& scene, const scene_params& params)
+{
+	ALLOC_SCOPE(ALLOC_SCENE_BUILD);
+	scene.spheres.clear();
+	scene.planes.clear();
+	scene.lights.clear();
+
+	// Inputs are drawn in braced lists only, which evaluate left to right, and
+	// with the rng_ helpers, so every compiler builds the same scene
+	std::mt19937 rng((unsigned) params.seed);
+	auto uniform = [&](float lo, float hi) { return rng_uniform(rng, lo, hi); };
+
+	const float near_z = 3;
+	const float far_z = 40;
+	const float ground_y = -1;
+	float size = glm::min(1.0f, glm::pow(64.0f / glm::max(params.spheres, 1), 1 / 3.0f));
+
+	int cluster_count = glm::max(1, params.spheres / 64);
+	std::vector<glm::vec3> clusters;
+	for (int i = 0; i < cluster_count; i++)
+	{
+		float z = uniform(near_z + 2, far_z);
+		clusters.push_back({ uniform(-0.7f, 0.7f) * z, uniform(-0.3f, 0.4f) * z, z });
+	}
+
+	static const int speculars[] = { -1, 10, 100, 500, 1000 };
+
+	for (int i = 0; i < params.spheres; i++)
+	{
+		sphere s;
+		s.radius = uniform(0.15f, 0.5f) * size;
+
+		if (params.layout == SCENE_CLUSTERED)
+		{
+			glm::vec3 cluster = clusters[i % cluster_count];
+			s.center = cluster + glm::vec3{ rng_gaussian(rng), rng_gaussian(rng), rng_gaussian(rng) } * (2 * size);
+		}
+		else if (params.layout == SCENE_STACKED)
+		{
+			float z = near_z + (far_z - near_z) * (i + 0.5f) / params.spheres;
+			s.center = { uniform(-0.3f, 0.3f), uniform(-0.3f, 0.3f), z };
+		}
+		else
+		{
+			float z = uniform(near_z, far_z);
+			s.center = { uniform(-0.85f, 0.85f) * z, uniform(-0.45f, 0.45f) * z, z };
+		}
+
+		if (params.ground)
+			s.center.y = glm::max(s.center.y, ground_y + s.radius);
+		s.center.z = glm::max(s.center.z, near_z);
+
+		s.color = { uniform(20, 255), uniform(20, 255), uniform(20, 255) };
+		s.specular = speculars[rng_index(rng, 5)];
+		s.reflective = uniform(0, 1) < params.reflective_fraction ? uniform(0.1f, 0.6f) : 0;
+		scene.spheres.push_back(s);
+	}
+
+	if (params.ground)
+	{
+		scene.planes.push_back({ .normal = {0, 1, 0}, .point = {0, ground_y, 0}, .color = {180, 180, 160},
+			.specular = 1000, .reflective = params.reflective_fraction > 0 ? 0.2f : 0 });
+	}
+
+	// Same totals as the demo scene whatever the count: 0.2 ambient, 0.6
+	// point and 0.2 directional
+	int count = glm::max(params.lights, 0);
+	for (int i = 0; i < count; i++)
+	{
+		scene.lights.push_back({ .intensity = 0.2f / count, .type = AMBIENT });
+		scene.lights.push_back({ .origin = { uniform(-8, 8), uniform(1, 6), uniform(-2, 25) }, .intensity = 0.6f / count, .type = POINT });
+		scene.lights.push_back({ .direction = { uniform(-1, 1), uniform(1, 4), uniform(-1, 4) }, .intensity = 0.2f / count, .type = DIRECTIONAL });
+	}
+}
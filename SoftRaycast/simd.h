@@ -0,0 +1,100 @@
+#pragma once
+#include <cmath>
+
+// Thin wrapper over the widest float SIMD the compiler is allowed to emit.
+// x64 always has SSE2 (4 lanes); building with /arch:AVX2 (or -mavx2)
+// switches to 8 lanes. Masks come out of the compares and feed
+// simd_select / simd_movemask.
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+#if SIMD_WIDTH == 8
+
+typedef __m256 simd_float;
+typedef __m256 simd_mask;
+
+simd_float simd_set1(float v) { return _mm256_set1_ps(v); }
+simd_float simd_load(const float* p) { return _mm256_loadu_ps(p); }
+void simd_store(float* p, simd_float v) { _mm256_storeu_ps(p, v); }
+simd_float simd_lane_index() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+
+simd_float simd_add(simd_float a, simd_float b) { return _mm256_add_ps(a, b); }
+simd_float simd_sub(simd_float a, simd_float b) { return _mm256_sub_ps(a, b); }
+simd_float simd_mul(simd_float a, simd_float b) { return _mm256_mul_ps(a, b); }
+simd_float simd_div(simd_float a, simd_float b) { return _mm256_div_ps(a, b); }
+simd_float simd_sqrt(simd_float a) { return _mm256_sqrt_ps(a); }
+simd_float simd_min(simd_float a, simd_float b) { return _mm256_min_ps(a, b); }
+simd_float simd_max(simd_float a, simd_float b) { return _mm256_max_ps(a, b); }
+
+simd_mask simd_gt(simd_float a, simd_float b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+simd_mask simd_lt(simd_float a, simd_float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+simd_mask simd_le(simd_float a, simd_float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+simd_mask simd_and(simd_mask a, simd_mask b) { return _mm256_and_ps(a, b); }
+simd_mask simd_or(simd_mask a, simd_mask b) { return _mm256_or_ps(a, b); }
+simd_mask simd_andnot(simd_mask a, simd_mask b) { return _mm256_andnot_ps(a, b); }
+// Lanes of b where mask is set, lanes of a elsewhere
+simd_float simd_select(simd_mask mask, simd_float a, simd_float b) { return _mm256_blendv_ps(a, b, mask); }
+int simd_movemask(simd_mask mask) { return _mm256_movemask_ps(mask); }
+
+#elif SIMD_WIDTH == 4
+
+typedef __m128 simd_float;
+typedef __m128 simd_mask;
+
+simd_float simd_set1(float v) { return _mm_set1_ps(v); }
+simd_float simd_load(const float* p) { return _mm_loadu_ps(p); }
+void simd_store(float* p, simd_float v) { _mm_storeu_ps(p, v); }
+simd_float simd_lane_index() { return _mm_setr_ps(0, 1, 2, 3); }
+
+simd_float simd_add(simd_float a, simd_float b) { return _mm_add_ps(a, b); }
+simd_float simd_sub(simd_float a, simd_float b) { return _mm_sub_ps(a, b); }
+simd_float simd_mul(simd_float a, simd_float b) { return _mm_mul_ps(a, b); }
+simd_float simd_div(simd_float a, simd_float b) { return _mm_div_ps(a, b); }
+simd_float simd_sqrt(simd_float a) { return _mm_sqrt_ps(a); }
+simd_float simd_min(simd_float a, simd_float b) { return _mm_min_ps(a, b); }
+simd_float simd_max(simd_float a, simd_float b) { return _mm_max_ps(a, b); }
+
+simd_mask simd_gt(simd_float a, simd_float b) { return _mm_cmpgt_ps(a, b); }
+simd_mask simd_lt(simd_float a, simd_float b) { return _mm_cmplt_ps(a, b); }
+simd_mask simd_le(simd_float a, simd_float b) { return _mm_cmple_ps(a, b); }
+simd_mask simd_and(simd_mask a, simd_mask b) { return _mm_and_ps(a, b); }
+simd_mask simd_or(simd_mask a, simd_mask b) { return _mm_or_ps(a, b); }
+simd_mask simd_andnot(simd_mask a, simd_mask b) { return _mm_andnot_ps(a, b); }
+simd_float simd_select(simd_mask mask, simd_float a, simd_float b) { return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a)); }
+int simd_movemask(simd_mask mask) { return _mm_movemask_ps(mask); }
+
+#else
+
+typedef float simd_float;
+typedef bool simd_mask;
+
+simd_float simd_set1(float v) { return v; }
+simd_float simd_load(const float* p) { return *p; }
+void simd_store(float* p, simd_float v) { *p = v; }
+simd_float simd_lane_index() { return 0; }
+
+simd_float simd_add(simd_float a, simd_float b) { return a + b; }
+simd_float simd_sub(simd_float a, simd_float b) { return a - b; }
+simd_float simd_mul(simd_float a, simd_float b) { return a * b; }
+simd_float simd_div(simd_float a, simd_float b) { return a / b; }
+simd_float simd_sqrt(simd_float a) { return std::sqrt(a); }
+simd_float simd_min(simd_float a, simd_float b) { return a < b ? a : b; }
+simd_float simd_max(simd_float a, simd_float b) { return a > b ? a : b; }
+
+simd_mask simd_gt(simd_float a, simd_float b) { return a > b; }
+simd_mask simd_lt(simd_float a, simd_float b) { return a < b; }
+simd_mask simd_le(simd_float a, simd_float b) { return a <= b; }
+simd_mask simd_and(simd_mask a, simd_mask b) { return a && b; }
+simd_mask simd_or(simd_mask a, simd_mask b) { return a || b; }
+simd_mask simd_andnot(simd_mask a, simd_mask b) { return !a && b; }
+simd_float simd_select(simd_mask mask, simd_float a, simd_float b) { return mask ? b : a; }
+int simd_movemask(simd_mask mask) { return mask ? 1 : 0; }
+
+#endif
@@ -0,0 +1,205 @@
+#pragma once
+#include <vector>
+#include <random>
+#include <limits>
+#include <cstdio>
+#include "glm/vec3.hpp"
+#include "glm/common.hpp"
+#include "glm/geometric.hpp"
+#include "geometry_scene.h"
+#include "raytrace.h"
+#include "ray_packet.h"
+
+// Rays of each kind cast per scene, a multiple of PACKET_SIZE
+#define SIMD_CHECK_RAYS 4096
+// Mismatches printed in full per scene, the rest are only counted
+#define SIMD_CHECK_REPORTS 4
+
+static_assert(SIMD_CHECK_RAYS % PACKET_SIZE == 0, "rays are packed in whole packets");
+
+// Kernels compared with the scalar closest_sphere_intersection
+enum simd_check_kernel
+{
+	CHECK_CLOSEST,
+	CHECK_CLOSEST_HOISTED,
+	CHECK_PACKET_CLOSEST,
+	CHECK_PACKET_HOISTED,
+	CHECK_ANY,
+	CHECK_PACKET_OCCLUDED,
+	CHECK_KERNEL_COUNT
+};
+
+const char* simd_check_kernel_name(int kernel)
+{
+	static const char* names[CHECK_KERNEL_COUNT] = { "closest", "hoisted", "packet", "packet hoisted", "any", "packet occluded" };
+	return names[kernel];
+}
+
+struct simd_check_counts
+{
+	const char* scene;
+	const std::vector<sphere>* spheres;
+	long long mismatches[CHECK_KERNEL_COUNT];
+	int reported;
+};
+
+// The scalar answer for r: sphere index (-1 on a miss) and distance
+soa_hit scalar_closest_sphere(const ray& r, geometry_scene& scene)
+{
+	ray copy = r;
+	hit_record hit = closest_sphere_intersection(copy, scene.spheres);
+	if (hit.hit_sphere == nullptr)
+		return { -1, hit.t };
+	return { (int) (hit.hit_sphere - &scene.spheres[0]), hit.t };
+}
+
+// A closest hit agrees with the scalar one by sphere_hits_agree, as
+// VALIDATE_SIMD_INTERSECTION checks it
+void check_closest(simd_check_counts& counts, int kernel, const ray& r, const soa_hit& scalar, const soa_hit& simd)
+{
+	if (sphere_hits_agree(r, *counts.spheres, scalar, simd))
+		return;
+
+	counts.mismatches[kernel]++;
+	if (counts.reported++ < SIMD_CHECK_REPORTS)
+	{
+		printf("  %s, %s: ray (%g, %g, %g) + t (%g, %g, %g): scalar sphere %d at %.9g, SIMD sphere %d at %.9g\n",
+			counts.scene, simd_check_kernel_name(kernel), r.origin.x, r.origin.y, r.origin.z, r.direction.x, r.direction.y, r.direction.z,
+			scalar.index, scalar.t, simd.index, simd.t);
+	}
+}
+
+// An any-hit query agrees when it finds a blocker exactly when the scalar
+// closest hit exists
+void check_any(simd_check_counts& counts, int kernel, const ray& r, const soa_hit& scalar, bool blocked)
+{
+	if (blocked == (scalar.index != -1))
+		return;
+
+	counts.mismatches[kernel]++;
+	if (counts.reported++ < SIMD_CHECK_REPORTS)
+	{
+		printf("  %s, %s: ray (%g, %g, %g) + t (%g, %g, %g) up to %g: scalar %s, SIMD %s\n",
+			counts.scene, simd_check_kernel_name(kernel), r.origin.x, r.origin.y, r.origin.z, r.direction.x, r.direction.y, r.direction.z,
+			r.t_max, scalar.index != -1 ? "blocked" : "clear", blocked ? "blocked" : "clear");
+	}
+}
+
+// Casts seeded pseudo random rays at the prepared scene and compares every
+// SIMD sphere kernel with the scalar scan: primary rays from the camera
+// origin (plain and hoisted), secondary rays from anywhere around the
+// spheres, and shadow rays of random length. Prints one row and returns
+// the number of mismatches.
+long long check_simd_kernels(const char* name, geometry_scene& scene, unsigned seed)
+{
+	simd_check_counts counts = {};
+	counts.scene = name;
+	counts.spheres = &scene.spheres;
+	const sphere_soa& soa = scene.sphere_geometry;
+
+	glm::vec3 origin = { 0, 0, 0 };
+	sphere_origin_soa hoisted;
+	hoisted.build(soa, origin);
+
+	glm::vec3 low = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 high = glm::vec3(-std::numeric_limits<float>::max());
+	for (const sphere& s : scene.spheres)
+	{
+		low = glm::min(low, s.center - glm::vec3(s.radius));
+		high = glm::max(high, s.center + glm::vec3(s.radius));
+	}
+
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> across(-1, 1);
+	std::uniform_real_distribution<float> unit(0, 1);
+
+	std::vector<ray> primary(SIMD_CHECK_RAYS);
+	std::vector<ray> secondary(SIMD_CHECK_RAYS);
+	std::vector<ray> shadow(SIMD_CHECK_RAYS);
+	for (int i = 0; i < SIMD_CHECK_RAYS; i++)
+	{
+		primary[i] = { origin, { across(rng), 0.6f * across(rng), 1 }, 1, std::numeric_limits<float>::infinity() };
+
+		glm::vec3 from = low + (high - low) * glm::vec3(unit(rng), unit(rng), unit(rng));
+		glm::vec3 direction = { across(rng), across(rng), across(rng) };
+		secondary[i] = { from, direction, EPSILON, std::numeric_limits<float>::infinity() };
+		shadow[i] = { from, direction, EPSILON, 0.1f + 2 * unit(rng) };
+	}
+
+	ray_packet packet;
+	float packet_t[PACKET_LANES];
+	int packet_hit[PACKET_LANES];
+
+	for (int i = 0; i < SIMD_CHECK_RAYS; i += PACKET_SIZE)
+	{
+		soa_hit scalar[PACKET_SIZE];
+
+		// Primary rays, which every kernel serves
+		packet.clear();
+		for (int l = 0; l < PACKET_SIZE; l++)
+		{
+			const ray& r = primary[i + l];
+			scalar[l] = scalar_closest_sphere(r, scene);
+			check_closest(counts, CHECK_CLOSEST, r, scalar[l], closest_sphere_intersection_soa(r, soa));
+			check_closest(counts, CHECK_CLOSEST_HOISTED, r, scalar[l], closest_sphere_intersection_soa(r, soa, &hoisted));
+			packet.set_ray(l, r);
+		}
+
+		packet_closest_sphere(packet, soa, packet_t, packet_hit);
+		for (int l = 0; l < PACKET_SIZE; l++)
+			check_closest(counts, CHECK_PACKET_CLOSEST, primary[i + l], scalar[l], { packet_hit[l], packet_t[l] });
+
+		packet_closest_sphere(packet, soa, packet_t, packet_hit, &hoisted);
+		for (int l = 0; l < PACKET_SIZE; l++)
+			check_closest(counts, CHECK_PACKET_HOISTED, primary[i + l], scalar[l], { packet_hit[l], packet_t[l] });
+
+		// Secondary rays start anywhere, so the hoisted terms do not apply
+		packet.clear();
+		for (int l = 0; l < PACKET_SIZE; l++)
+		{
+			const ray& r = secondary[i + l];
+			scalar[l] = scalar_closest_sphere(r, scene);
+			check_closest(counts, CHECK_CLOSEST, r, scalar[l], closest_sphere_intersection_soa(r, soa));
+			packet.set_ray(l, r);
+		}
+
+		packet_closest_sphere(packet, soa, packet_t, packet_hit);
+		for (int l = 0; l < PACKET_SIZE; l++)
+			check_closest(counts, CHECK_PACKET_CLOSEST, secondary[i + l], scalar[l], { packet_hit[l], packet_t[l] });
+
+		// Shadow rays end before infinity, like the ones cast at point lights
+		packet.clear();
+		for (int l = 0; l < PACKET_SIZE; l++)
+		{
+			const ray& r = shadow[i + l];
+			scalar[l] = scalar_closest_sphere(r, scene);
+			check_any(counts, CHECK_ANY, r, scalar[l], any_sphere_intersection_soa(r, soa) != -1);
+			packet.set_ray(l, r);
+		}
+
+		int hint = 0;
+		unsigned occluded = packet_occluded(packet, soa, &hint);
+		for (int l = 0; l < PACKET_SIZE; l++)
+			check_any(counts, CHECK_PACKET_OCCLUDED, shadow[i + l], scalar[l], (occluded >> l) & 1);
+	}
+
+	long long mismatches = 0;
+	printf("%-16s %8d", name, (int) scene.spheres.size());
+	for (int k = 0; k < CHECK_KERNEL_COUNT; k++)
+	{
+		printf(" %15lld", counts.mismatches[k]);
+		mismatches += counts.mismatches[k];
+	}
+	printf("\n");
+	return mismatches;
+}
+
+void print_simd_check_header()
+{
+	printf("Mismatches against the scalar scan, %d rays of each kind per scene, SIMD width %d, ulp tolerance %d\n",
+		SIMD_CHECK_RAYS, SIMD_WIDTH, SIMD_ULP_TOLERANCE);
+	printf("%-16s %8s", "scene", "spheres");
+	for (int k = 0; k < CHECK_KERNEL_COUNT; k++)
+		printf(" %15s", simd_check_kernel_name(k));
+	printf("\n");
+}
@@ -0,0 +1,308 @@
+#pragma once
+#include <vector>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+#include <cfloat>
+#include <cmath>
+#include "glm/geometric.hpp"
+#include "glm/vec3.hpp"
+#include "sphere.h"
+#include "ray.h"
+#include "simd.h"
+#include "render_stats.h"
+
+// Structure-of-arrays mirror of the sphere geometry. Only what the
+// intersection loop needs is stored, so material data stays out of cache.
+// Arrays are padded to SIMD_WIDTH with spheres that can never be hit
+// (radius2 = -inf makes the discriminant -inf).
+struct sphere_soa
+{
+	int count = 0;
+	int padded_count = 0;
+	std::vector<float> center_x;
+	std::vector<float> center_y;
+	std::vector<float> center_z;
+	std::vector<float> radius2;
+
+	void build(const std::vector<sphere>& spheres)
+	{
+		count = (int) spheres.size();
+		padded_count = (count + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+
+		center_x.assign(padded_count, 0);
+		center_y.assign(padded_count, 0);
+		center_z.assign(padded_count, 0);
+		radius2.assign(padded_count, -std::numeric_limits<float>::infinity());
+
+		for (int i = 0; i < count; i++)
+		{
+			center_x[i] = spheres[i].center.x;
+			center_y[i] = spheres[i].center.y;
+			center_z[i] = spheres[i].center.z;
+			radius2[i] = spheres[i].radius * spheres[i].radius;
+		}
+	}
+};
+
+// Roots of SIMD_WIDTH ray-sphere pairs, far one first
+struct simd_roots
+{
+	simd_mask hit;
+	simd_float t0;
+	simd_float t1;
+};
+
+// Roots from the b and c terms of the quadratic
+simd_roots simd_solve_quadratic(simd_float a, simd_float b, simd_float c)
+{
+	simd_float zero = simd_set1(0);
+	simd_float in_sqrt = simd_sub(simd_mul(b, b), simd_mul(simd_mul(simd_set1(4), a), c));
+
+	simd_roots roots;
+	roots.hit = simd_gt(in_sqrt, zero);
+
+	// Stable form of intersect_sphere: q = -(b + sign(b) * root) / 2,
+	// roots q / a and c / q. Only lanes that hit have q != 0.
+	simd_float root = simd_sqrt(simd_max(in_sqrt, zero));
+	simd_float signed_root = simd_select(simd_lt(b, zero), root, simd_sub(zero, root));
+	simd_float q = simd_mul(simd_set1(-0.5f), simd_add(b, signed_root));
+	simd_float x0 = simd_div(q, a);
+	simd_float x1 = simd_div(c, q);
+	roots.t0 = simd_max(x0, x1);
+	roots.t1 = simd_min(x0, x1);
+	return roots;
+}
+
+simd_float simd_sphere_b(simd_float ocx, simd_float ocy, simd_float ocz, simd_float dx, simd_float dy, simd_float dz)
+{
+	return simd_mul(simd_add(simd_add(simd_mul(ocx, dx), simd_mul(ocy, dy)), simd_mul(ocz, dz)), simd_set1(2));
+}
+
+// Quadratic of intersect_sphere with the same operations in the same order.
+// Lanes match the scalar result bit for bit only when the compiler contracts
+// neither path into FMAs; otherwise they agree as sphere_hits_agree checks.
+simd_roots simd_solve_sphere(simd_float ocx, simd_float ocy, simd_float ocz, simd_float dx, simd_float dy, simd_float dz,
+	simd_float a, simd_float radius2)
+{
+	simd_float b = simd_sphere_b(ocx, ocy, ocz, dx, dy, dz);
+	simd_float c = simd_sub(simd_add(simd_add(simd_mul(ocx, ocx), simd_mul(ocy, ocy)), simd_mul(ocz, ocz)), radius2);
+	return simd_solve_quadratic(a, b, c);
+}
+
+// Ray-independent part of the sphere quadratic for rays that all start at
+// origin, i.e. the primary rays of a frame: oc = origin - center and
+// c = dot(oc, oc) - radius^2. c < 0 exactly when origin is inside the sphere.
+struct sphere_origin_soa
+{
+	glm::vec3 origin = glm::vec3(0);
+	int padded_count = 0;
+	std::vector<float> oc_x;
+	std::vector<float> oc_y;
+	std::vector<float> oc_z;
+	std::vector<float> c;
+
+	void build(const sphere_soa& soa, const glm::vec3& o)
+	{
+		origin = o;
+		padded_count = soa.padded_count;
+		oc_x.resize(padded_count);
+		oc_y.resize(padded_count);
+		oc_z.resize(padded_count);
+		c.resize(padded_count);
+
+		for (int i = 0; i < padded_count; i++)
+		{
+			oc_x[i] = origin.x - soa.center_x[i];
+			oc_y[i] = origin.y - soa.center_y[i];
+			oc_z[i] = origin.z - soa.center_z[i];
+			c[i] = oc_x[i] * oc_x[i] + oc_y[i] * oc_y[i] + oc_z[i] * oc_z[i] - soa.radius2[i];
+		}
+	}
+
+	// Whether this holds the terms of soa for rays starting at o
+	bool built_for(const sphere_soa& soa, const glm::vec3& o) const
+	{
+		return padded_count == soa.padded_count && padded_count > 0 && o == origin;
+	}
+
+	// Whether a ray can use this data instead of the full quadratic
+	bool serves(const ray& r, const sphere_soa& soa) const
+	{
+		return built_for(soa, r.origin) && r.t_min >= 0;
+	}
+};
+
+// Sphere quadratic with oc and c already known. When the origin is outside
+// a sphere (c > 0) and b >= 0 both roots are <= 0, so the sphere is
+// reported as a miss; callers guarantee t_min >= 0.
+simd_roots simd_solve_hoisted_sphere(simd_float ocx, simd_float ocy, simd_float ocz, simd_float c, simd_float dx, simd_float dy, simd_float dz, simd_float a)
+{
+	simd_float b = simd_sphere_b(ocx, ocy, ocz, dx, dy, dz);
+
+	simd_roots roots = simd_solve_quadratic(a, b, c);
+	simd_float zero = simd_set1(0);
+	roots.hit = simd_and(roots.hit, simd_or(simd_lt(c, zero), simd_lt(b, zero)));
+	return roots;
+}
+
+// One ray broadcast to every lane
+struct simd_ray
+{
+	simd_float ox, oy, oz;
+	simd_float dx, dy, dz;
+	simd_float a;
+	simd_float t_min, t_max;
+
+	simd_ray(const ray& r)
+	{
+		ox = simd_set1(r.origin.x);
+		oy = simd_set1(r.origin.y);
+		oz = simd_set1(r.origin.z);
+		dx = simd_set1(r.direction.x);
+		dy = simd_set1(r.direction.y);
+		dz = simd_set1(r.direction.z);
+		a = simd_set1(glm::dot(r.direction, r.direction));
+		t_min = simd_set1(r.t_min);
+		t_max = simd_set1(r.t_max);
+	}
+};
+
+// Roots of r against spheres [i, i + SIMD_WIDTH)
+simd_roots simd_intersect_spheres(const simd_ray& r, const sphere_soa& soa, int i)
+{
+	simd_float ocx = simd_sub(r.ox, simd_load(&soa.center_x[i]));
+	simd_float ocy = simd_sub(r.oy, simd_load(&soa.center_y[i]));
+	simd_float ocz = simd_sub(r.oz, simd_load(&soa.center_z[i]));
+	return simd_solve_sphere(ocx, ocy, ocz, r.dx, r.dy, r.dz, r.a, simd_load(&soa.radius2[i]));
+}
+
+// Roots of r against spheres [i, i + SIMD_WIDTH) from their hoisted terms
+simd_roots simd_intersect_hoisted_spheres(const simd_ray& r, const sphere_origin_soa& hoisted, int i)
+{
+	return simd_solve_hoisted_sphere(simd_load(&hoisted.oc_x[i]), simd_load(&hoisted.oc_y[i]), simd_load(&hoisted.oc_z[i]), simd_load(&hoisted.c[i]),
+		r.dx, r.dy, r.dz, r.a);
+}
+
+struct soa_hit
+{
+	int index;
+	float t;
+};
+
+// Tests r against SIMD_WIDTH spheres per step and returns the index of the
+// nearest one hit inside (t_min, t_max), or -1. Follows the same arithmetic
+// and tie breaking as closest_sphere_intersection, so both agree on t.
+// hoisted, when given, must serve r.
+soa_hit closest_sphere_intersection_soa(const ray& r, const sphere_soa& soa, const sphere_origin_soa* hoisted = nullptr)
+{
+	simd_ray sr(r);
+
+	simd_float best_t = simd_set1(std::numeric_limits<float>::max());
+	simd_float best_index = simd_set1(-1);
+	simd_float index = simd_lane_index();
+	simd_float step = simd_set1(SIMD_WIDTH);
+
+	for (int i = 0; i < soa.padded_count; i += SIMD_WIDTH, index = simd_add(index, step))
+	{
+		simd_roots roots = hoisted != nullptr ? simd_intersect_hoisted_spheres(sr, *hoisted, i) : simd_intersect_spheres(sr, soa, i);
+		STAT_ADD(sphere_tests, glm::min(SIMD_WIDTH, soa.count - i));
+		if (simd_movemask(roots.hit) == 0)
+			continue;
+
+#if RENDER_STATS
+		simd_mask in0 = simd_and(simd_gt(roots.t0, sr.t_min), simd_lt(roots.t0, sr.t_max));
+		simd_mask in1 = simd_and(simd_gt(roots.t1, sr.t_min), simd_lt(roots.t1, sr.t_max));
+		STAT_ADD(sphere_hits, count_bits(simd_movemask(simd_and(roots.hit, simd_or(in0, in1)))));
+#endif
+
+		// Same order as the scalar path: the far root first, then the near one
+		simd_mask take0 = simd_and(roots.hit, simd_and(simd_and(simd_gt(roots.t0, sr.t_min), simd_lt(roots.t0, sr.t_max)), simd_lt(roots.t0, best_t)));
+		best_t = simd_select(take0, best_t, roots.t0);
+		best_index = simd_select(take0, best_index, index);
+
+		simd_mask take1 = simd_and(roots.hit, simd_and(simd_and(simd_gt(roots.t1, sr.t_min), simd_lt(roots.t1, sr.t_max)), simd_lt(roots.t1, best_t)));
+		best_t = simd_select(take1, best_t, roots.t1);
+		best_index = simd_select(take1, best_index, index);
+	}
+
+	float lane_t[SIMD_WIDTH];
+	float lane_index[SIMD_WIDTH];
+	simd_store(lane_t, best_t);
+	simd_store(lane_index, best_index);
+
+	// Lowest sphere index wins ties, like the in-order scalar scan
+	soa_hit closest = { -1, std::numeric_limits<float>::max() };
+	for (int l = 0; l < SIMD_WIDTH; l++)
+	{
+		int i = (int) lane_index[l];
+		if (i < 0)
+			continue;
+
+		if (lane_t[l] < closest.t || (lane_t[l] == closest.t && i < closest.index))
+			closest = { i, lane_t[l] };
+	}
+
+	return closest;
+}
+
+// Index of a sphere hit inside (t_min, t_max), or -1. Returns at the first
+// SIMD step that finds a blocker, which is all a shadow ray needs.
+int any_sphere_intersection_soa(const ray& r, const sphere_soa& soa)
+{
+	simd_ray sr(r);
+
+	for (int i = 0; i < soa.padded_count; i += SIMD_WIDTH)
+	{
+		simd_roots roots = simd_intersect_spheres(sr, soa, i);
+		simd_mask in0 = simd_and(simd_gt(roots.t0, sr.t_min), simd_lt(roots.t0, sr.t_max));
+		simd_mask in1 = simd_and(simd_gt(roots.t1, sr.t_min), simd_lt(roots.t1, sr.t_max));
+
+		int blocked = simd_movemask(simd_and(roots.hit, simd_or(in0, in1)));
+		STAT_ADD(sphere_tests, glm::min(SIMD_WIDTH, soa.count - i));
+		STAT_ADD(sphere_hits, count_bits(blocked));
+		if (blocked == 0)
+			continue;
+
+		for (int l = 0; l < SIMD_WIDTH; l++)
+			if ((blocked >> l) & 1)
+				return i + l;
+	}
+
+	return -1;
+}
+
+// Distance in units in the last place between two finite floats
+uint32_t ulp_distance(float a, float b)
+{
+	int32_t ia, ib;
+	memcpy(&ia, &a, sizeof(float));
+	memcpy(&ib, &b, sizeof(float));
+
+	// Map the sign-magnitude representation onto a monotonic integer line
+	if (ia < 0) ia = INT32_MIN - ia;
+	if (ib < 0) ib = INT32_MIN - ib;
+
+	return ia > ib ? (uint32_t) ia - (uint32_t) ib : (uint32_t) ib - (uint32_t) ia;
+}
+
+// How far a float root of r against s may stray from the exact one. The
+// discriminant b^2 - 4ac keeps only the digits its terms do not cancel, and
+// a root moves by its error over 4a * sqrt(disc); paths that round or
+// contract into FMAs differently can each land anywhere in that range.
+// Infinite for grazing rays, where even hit or miss is not well defined.
+double sphere_root_error(const ray& r, const sphere& s)
+{
+	glm::dvec3 oc = glm::dvec3(r.origin) - glm::dvec3(s.center);
+	glm::dvec3 d = glm::dvec3(r.direction);
+	double radius2 = (double) s.radius * s.radius;
+	double a = glm::dot(d, d);
+	double b = glm::dot(oc, d) * 2;
+	double c = glm::dot(oc, oc) - radius2;
+
+	double disc = b * b - 4 * a * c;
+	double disc_error = FLT_EPSILON * (b * b + 4 * a * (glm::dot(oc, oc) + radius2));
+	if (disc <= disc_error)
+		return std::numeric_limits<double>::infinity();
+	return disc_error / (4 * a * std::sqrt(disc));
+}
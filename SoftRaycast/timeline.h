@@ -0,0 +1,188 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+
+// Scoped timing zones, written out as a Chrome trace_event JSON file that
+// chrome://tracing or ui.perfetto.dev can open. When 0 every TIMELINE_ZONE
+// compiles to nothing.
+#define TIMELINE 1
+// Events per block. Each thread fills its own block and claims the next
+// free one when it is full, so recording never locks or allocates.
+#define TIMELINE_BLOCK_EVENTS 256
+
+struct timeline_event
+{
+	// String literal, never copied
+	const char* name;
+	long long begin_ns;
+	long long end_ns;
+	// Shown as args.id, -1 for none
+	int id;
+};
+
+struct timeline_block
+{
+	int thread;
+	int count;
+	timeline_event events[TIMELINE_BLOCK_EVENTS];
+};
+
+struct timeline_recorder
+{
+	std::vector<timeline_block> blocks;
+	std::atomic<int> blocks_used{ 0 };
+	std::atomic<int> threads{ 0 };
+	std::atomic<long long> dropped{ 0 };
+	// Bumped by every start so threads drop blocks of an earlier recording
+	std::atomic<int> generation{ 0 };
+	std::chrono::steady_clock::time_point epoch;
+	bool recording = false;
+} timeline;
+
+struct timeline_thread_state
+{
+	int generation = -1;
+	int thread = -1;
+	timeline_block* block = nullptr;
+};
+
+thread_local timeline_thread_state timeline_thread;
+
+long long timeline_now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - timeline.epoch).count();
+}
+
+// Starts recording with room for about max_events events. The calling thread
+// becomes thread 0 ("main"). Call while no other thread is recording.
+void timeline_start(int max_events)
+{
+	int block_count = (max_events + TIMELINE_BLOCK_EVENTS - 1) / TIMELINE_BLOCK_EVENTS;
+	timeline.blocks.assign(block_count > 0 ? block_count : 1, timeline_block());
+	timeline.blocks_used = 0;
+	timeline.threads = 0;
+	timeline.dropped = 0;
+	timeline.generation++;
+	timeline.epoch = std::chrono::steady_clock::now();
+	timeline.recording = true;
+}
+
+void timeline_stop()
+{
+	timeline.recording = false;
+}
+
+void timeline_record(const char* name, long long begin_ns, long long end_ns, int id)
+{
+	timeline_thread_state& state = timeline_thread;
+
+	if (state.generation != timeline.generation)
+	{
+		state.generation = timeline.generation;
+		state.thread = timeline.threads.fetch_add(1);
+		state.block = nullptr;
+	}
+
+	if (state.block == nullptr || state.block->count == TIMELINE_BLOCK_EVENTS)
+	{
+		int index = timeline.blocks_used.fetch_add(1);
+		if (index >= (int) timeline.blocks.size())
+		{
+			state.block = nullptr;
+			timeline.dropped++;
+			return;
+		}
+
+		state.block = &timeline.blocks[index];
+		state.block->thread = state.thread;
+		state.block->count = 0;
+	}
+
+	state.block->events[state.block->count++] = { name, begin_ns, end_ns, id };
+}
+
+// Records the time between its construction and destruction
+struct timeline_zone
+{
+	const char* name;
+	int id;
+	long long begin_ns;
+
+	timeline_zone(const char* zone_name, int zone_id = -1) : name(zone_name), id(zone_id), begin_ns(-1)
+	{
+		if (timeline.recording)
+			begin_ns = timeline_now();
+	}
+
+	~timeline_zone()
+	{
+		if (begin_ns >= 0 && timeline.recording)
+			timeline_record(name, begin_ns, timeline_now(), id);
+	}
+
+	timeline_zone(const timeline_zone&) = delete;
+	timeline_zone& operator=(const timeline_zone&) = delete;
+};
+
+#define TIMELINE_CONCAT_INNER(a, b) a##b
+#define TIMELINE_CONCAT(a, b) TIMELINE_CONCAT_INNER(a, b)
+
+#if TIMELINE
+#define TIMELINE_ZONE(name) timeline_zone TIMELINE_CONCAT(timeline_zone_, __LINE__)(name)
+#define TIMELINE_ZONE_ID(name, id) timeline_zone TIMELINE_CONCAT(timeline_zone_, __LINE__)(name, id)
+#else
+#define TIMELINE_ZONE(name) ((void) 0)
+#define TIMELINE_ZONE_ID(name, id) ((void) 0)
+#endif
+
+// Writes every recorded event as a complete ("X") event, plus thread name
+// metadata. Call once the threads that record have finished their work.
+bool write_timeline(const char* path)
+{
+	std::ofstream file(path);
+	if (!file)
+	{
+		printf("Cannot write '%s'\n", path);
+		return false;
+	}
+
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+	int threads = timeline.threads.load();
+	for (int t = 0; t < threads; t++)
+	{
+		std::string thread_name = t == 0 ? "main" : "worker " + std::to_string(t);
+		file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t << ",\"args\":{\"name\":\"" << thread_name << "\"}},\n";
+	}
+
+	int used = timeline.blocks_used.load();
+	int event_count = 0;
+	char line[256];
+	for (int b = 0; b < used && b < (int) timeline.blocks.size(); b++)
+	{
+		const timeline_block& block = timeline.blocks[b];
+		for (int e = 0; e < block.count; e++)
+		{
+			const timeline_event& event = block.events[e];
+			snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+				event.name, block.thread, event.begin_ns / 1000.0, (event.end_ns - event.begin_ns) / 1000.0);
+			file << line;
+			if (event.id >= 0)
+				file << ",\"args\":{\"id\":" << event.id << "}";
+			file << "},\n";
+			event_count++;
+		}
+	}
+
+	// Closes the list without a trailing comma
+	file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"SoftRaycast\"}}\n]}\n";
+
+	if (timeline.dropped > 0)
+		printf("Timeline full, %lld events dropped\n", timeline.dropped.load());
+	printf("Timeline with %d events from %d threads written to %s\n", event_count, threads, path);
+	return (bool) file;
+}
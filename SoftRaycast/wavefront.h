@@ -0,0 +1,236 @@
+#pragma once
+#include <limits>
+#include "glm/vec3.hpp"
+#include "glm/geometric.hpp"
+#include "geometry_scene.h"
+#include "raytrace.h"
+#include "ray_packet.h"
+#include "frame_timing.h"
+
+// Rays one wavefront can hold, enough for a 32x32 tile
+#define WAVEFRONT_MAX_RAYS 1024
+
+static_assert(WAVEFRONT_MAX_RAYS % PACKET_SIZE == 0, "stages run in whole packets");
+
+// Rays of one bounce. pixel is where the ray's contribution lands and
+// weight is the product of the reflectivities it has bounced off so far.
+struct wavefront_queue
+{
+	ray rays[WAVEFRONT_MAX_RAYS];
+	int pixel[WAVEFRONT_MAX_RAYS];
+	float weight[WAVEFRONT_MAX_RAYS];
+	int count;
+
+	void clear()
+	{
+		count = 0;
+	}
+
+	void push(const ray& r, int p, float w)
+	{
+		rays[count] = r;
+		pixel[count] = p;
+		weight[count] = w;
+		count++;
+	}
+};
+
+// Everything a wavefront needs between stages. Too large for the stack, so
+// each thread keeps one (see wavefront_buffers) and reuses it every tile.
+struct wavefront_state
+{
+	wavefront_queue queues[2];
+
+	// Intersection results of the current queue
+	float t[WAVEFRONT_MAX_RAYS];
+	int hit[WAVEFRONT_MAX_RAYS];
+	int plane_hit[WAVEFRONT_MAX_RAYS];
+
+	// Queue entries that hit a surface, and their shading inputs
+	int shaded[WAVEFRONT_MAX_RAYS];
+	int shaded_count;
+	glm::vec3 point[WAVEFRONT_MAX_RAYS];
+	surface surf[WAVEFRONT_MAX_RAYS];
+	glm::vec3 view[WAVEFRONT_MAX_RAYS];
+	float intensity[WAVEFRONT_MAX_RAYS];
+
+	// Shadow queue of the light being processed, one ray per shaded entry
+	ray shadow_rays[WAVEFRONT_MAX_RAYS];
+	glm::vec3 light_dir[WAVEFRONT_MAX_RAYS];
+	bool blocked[WAVEFRONT_MAX_RAYS];
+
+	// Output colour per pixel of the tile
+	glm::vec3 color[WAVEFRONT_MAX_RAYS];
+};
+
+thread_local wavefront_state wavefront_buffers;
+
+// Intersection stage: closest hit of every ray in the queue, PACKET_SIZE rays
+// at a time through the packet kernels
+void wavefront_intersect(const wavefront_queue& queue, geometry_scene& scene, float* t, int* hit, int* plane_hit)
+{
+	ray_packet packet;
+	float packet_t[PACKET_LANES];
+	int packet_hit[PACKET_LANES];
+	int packet_plane_hit[PACKET_LANES];
+
+	for (int first = 0; first < queue.count; first += PACKET_SIZE)
+	{
+		int n = glm::min(PACKET_SIZE, queue.count - first);
+
+		packet.clear();
+		for (int i = 0; i < n; i++)
+			packet.set_ray(i, queue.rays[first + i]);
+
+		packet_closest_hit(packet, scene, packet_t, packet_hit, packet_plane_hit);
+
+		for (int i = 0; i < n; i++)
+		{
+			t[first + i] = packet_t[i];
+			hit[first + i] = packet_hit[i];
+			plane_hit[first + i] = packet_plane_hit[i];
+		}
+	}
+}
+
+// Shadow stage: which of the count rays are blocked before reaching light_index
+void wavefront_shadow(const ray* rays, int count, geometry_scene& scene, int light_index, bool* blocked)
+{
+	ray_packet packet;
+
+	for (int first = 0; first < count; first += PACKET_SIZE)
+	{
+		int n = glm::min(PACKET_SIZE, count - first);
+
+		packet.clear();
+		for (int i = 0; i < n; i++)
+			packet.set_ray(i, rays[first + i]);
+
+		unsigned shadowed = packet_shadowed(packet, scene, light_index);
+		for (int i = 0; i < n; i++)
+			blocked[first + i] = (shadowed >> i) & 1;
+	}
+}
+
+// Traces the rays in state.queues[0] (with pixel indices below pixel_count)
+// bounce by bounce and writes the final colours to state.color. Instead of
+// recursing, a reflective hit adds weight * colour * (1 - reflective) to its
+// pixel and queues the reflected ray with weight * reflective.
+void trace_wavefront(wavefront_state& state, int pixel_count, geometry_scene& scene, glm::vec3& back_color, int max_depth)
+{
+	for (int i = 0; i < pixel_count; i++)
+		state.color[i] = glm::vec3(0);
+
+	// Time in the intersection stages, the rest is shading (see frame_stage)
+	bool timed = stage_timing;
+	long long begin_ns = timed ? stage_clock_ns() : 0;
+	long long trace_ns = 0;
+	long long stage_ns;
+
+	int current = 0;
+	for (int depth = 0; depth <= max_depth && state.queues[current].count > 0; depth++)
+	{
+		wavefront_queue& queue = state.queues[current];
+		wavefront_queue& next = state.queues[current ^ 1];
+		next.clear();
+
+		STAT_ADD(rays[depth == 0 ? STATS_PRIMARY : STATS_REFLECTION][stats_depth(depth)], queue.count);
+		stage_ns = timed ? stage_clock_ns() : 0;
+		wavefront_intersect(queue, scene, state.t, state.hit, state.plane_hit);
+		trace_ns += timed ? stage_clock_ns() - stage_ns : 0;
+
+		// Misses take the background, hits get their shading inputs
+		state.shaded_count = 0;
+		for (int i = 0; i < queue.count; i++)
+		{
+			if (state.hit[i] < 0 && state.plane_hit[i] < 0)
+			{
+				state.color[queue.pixel[i]] += queue.weight[i] * back_color;
+				STAT_ADD(path_ends[STATS_END_MISS], 1);
+				continue;
+			}
+
+			int k = state.shaded_count++;
+			state.shaded[k] = i;
+			state.point[k] = queue.rays[i].get_point(state.t[i]);
+			state.surf[k] = state.hit[i] >= 0 ? sphere_surface(scene.spheres[state.hit[i]], state.point[k])
+				: plane_surface(scene.planes[state.plane_hit[i]], queue.rays[i].direction);
+			state.view[k] = -queue.rays[i].direction;
+			state.intensity[k] = 0;
+		}
+
+		// Lights in scene order, so intensities add up as in compute_lighting
+		for (light& l : scene.lights)
+		{
+			ALLOC_SCOPE(ALLOC_LIGHTING);
+			int light_index = (int) (&l - scene.lights.data());
+
+			if (l.type == AMBIENT)
+			{
+				for (int k = 0; k < state.shaded_count; k++)
+					state.intensity[k] += l.intensity;
+				continue;
+			}
+
+			for (int k = 0; k < state.shaded_count; k++)
+			{
+				ray& shadow_ray = state.shadow_rays[k];
+				light_direction(l, state.point[k], state.light_dir[k], shadow_ray.t_max);
+				shadow_ray.origin = state.point[k];
+				shadow_ray.t_min = EPSILON;
+				shadow_ray.direction = state.light_dir[k];
+			}
+
+			STAT_ADD(rays[STATS_SHADOW][stats_depth(depth)], state.shaded_count);
+			stage_ns = timed ? stage_clock_ns() : 0;
+			wavefront_shadow(state.shadow_rays, state.shaded_count, scene, light_index, state.blocked);
+			trace_ns += timed ? stage_clock_ns() - stage_ns : 0;
+
+			for (int k = 0; k < state.shaded_count; k++)
+			{
+				if (state.blocked[k])
+				{
+					STAT_ADD(light_samples_shadowed, 1);
+					continue;
+				}
+
+				STAT_ADD(light_samples_lit, 1);
+
+				add_light_contribution(l, state.light_dir[k], state.view[k], state.surf[k].normal, state.surf[k].specular, state.intensity[k]);
+			}
+		}
+
+		// Resolve the bounce and queue the reflections
+		for (int k = 0; k < state.shaded_count; k++)
+		{
+			int i = state.shaded[k];
+			surface& s = state.surf[k];
+			glm::vec3 color = s.color * (float) glm::clamp(state.intensity[k], 0.0f, 1.0f);
+			float weight = queue.weight[i];
+
+			if (depth >= max_depth || s.reflective <= 0)
+			{
+				state.color[queue.pixel[i]] += weight * color;
+				STAT_ADD(path_ends[s.reflective <= 0 ? STATS_END_NOT_REFLECTIVE : STATS_END_MAX_DEPTH], 1);
+				continue;
+			}
+
+			state.color[queue.pixel[i]] += weight * (color * (1 - s.reflective));
+
+			ray reflect_ray;
+			reflect_ray.origin = state.point[k];
+			reflect_ray.t_min = EPSILON;
+			reflect_ray.t_max = std::numeric_limits<float>::infinity();
+			reflect_ray.direction = reflect(state.view[k], s.normal);
+			next.push(reflect_ray, queue.pixel[i], weight * s.reflective);
+		}
+
+		current ^= 1;
+	}
+
+	if (timed)
+	{
+		wavefront_trace_ns += trace_ns;
+		wavefront_shade_ns += stage_clock_ns() - begin_ns - trace_ns;
+	}
+}
@@ -0,0 +1,277 @@
+#pragma once
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include "glm/vec3.hpp"
+#include "glm/common.hpp"
+#include "bvh.h"
+#include "ray.h"
+#include "simd.h"
+
+// Children per node. One SIMD step tests every child box of a node
+#define WIDE_BVH_WIDTH (SIMD_WIDTH >= 4 ? SIMD_WIDTH : 4)
+// Store child boxes as 8 bit offsets from the node box instead of floats
+#define WIDE_BVH_QUANTIZED 0
+// Traversal stack: up to WIDE_BVH_WIDTH entries per level of the tree
+#define WIDE_BVH_STACK_SIZE ((BVH_MAX_DEPTH + 2) * WIDE_BVH_WIDTH)
+
+static_assert(WIDE_BVH_WIDTH % SIMD_WIDTH == 0, "a wide node must fill whole SIMD steps");
+
+// Child boxes of a node in float SoA form
+struct wide_bvh_bounds
+{
+	float min_x[WIDE_BVH_WIDTH], min_y[WIDE_BVH_WIDTH], min_z[WIDE_BVH_WIDTH];
+	float max_x[WIDE_BVH_WIDTH], max_y[WIDE_BVH_WIDTH], max_z[WIDE_BVH_WIDTH];
+};
+
+// Multi-branching node. Slots past child_count are unused. Interior children
+// have count 0 and child is a node index. Leaves cover
+// wide_bvh::indices[child, child + count).
+struct wide_bvh_node
+{
+#if WIDE_BVH_QUANTIZED
+	glm::vec3 origin;
+	glm::vec3 scale;
+	unsigned char q_min_x[WIDE_BVH_WIDTH], q_min_y[WIDE_BVH_WIDTH], q_min_z[WIDE_BVH_WIDTH];
+	unsigned char q_max_x[WIDE_BVH_WIDTH], q_max_y[WIDE_BVH_WIDTH], q_max_z[WIDE_BVH_WIDTH];
+#else
+	wide_bvh_bounds bounds;
+#endif
+	int child[WIDE_BVH_WIDTH];
+	int count[WIDE_BVH_WIDTH];
+	int child_count;
+};
+
+struct wide_bvh
+{
+	std::vector<wide_bvh_node> nodes;
+	// Shares the leaf ordering of the binary tree it was collapsed from
+	std::vector<int> indices;
+
+	int sphere_count = 0;
+	int node_count = 0;
+	int leaf_count = 0;
+	double build_ms = 0;
+
+	bool empty() const
+	{
+		return nodes.empty();
+	}
+};
+
+#if WIDE_BVH_QUANTIZED
+float dequantize(float origin, unsigned char q, float scale)
+{
+	return origin + (float) q * scale;
+}
+
+// Rounds a child box outwards onto the node grid, stepping until the
+// dequantized value really contains the float bound
+void quantize_bounds(float origin, float scale, float lo, float hi, unsigned char& q_lo, unsigned char& q_hi)
+{
+	int a = glm::clamp((int) std::floor((lo - origin) / scale), 0, 255);
+	int b = glm::clamp((int) std::ceil((hi - origin) / scale), 0, 255);
+
+	while (a > 0 && dequantize(origin, (unsigned char) a, scale) > lo)
+		a--;
+	while (b < 255 && dequantize(origin, (unsigned char) b, scale) < hi)
+		b++;
+
+	q_lo = (unsigned char) a;
+	q_hi = (unsigned char) b;
+}
+#endif
+
+#if WIDE_BVH_QUANTIZED
+// Float child boxes of a quantized node
+void wide_bvh_dequantize(const wide_bvh_node& node, wide_bvh_bounds& bounds)
+{
+	for (int i = 0; i < WIDE_BVH_WIDTH; i++)
+	{
+		bounds.min_x[i] = dequantize(node.origin.x, node.q_min_x[i], node.scale.x);
+		bounds.min_y[i] = dequantize(node.origin.y, node.q_min_y[i], node.scale.y);
+		bounds.min_z[i] = dequantize(node.origin.z, node.q_min_z[i], node.scale.z);
+		bounds.max_x[i] = dequantize(node.origin.x, node.q_max_x[i], node.scale.x);
+		bounds.max_y[i] = dequantize(node.origin.y, node.q_max_y[i], node.scale.y);
+		bounds.max_z[i] = dequantize(node.origin.z, node.q_max_z[i], node.scale.z);
+	}
+}
+#endif
+
+void wide_bvh_set_child_bounds(wide_bvh_node& node, int slot, const glm::vec3& lo, const glm::vec3& hi)
+{
+#if WIDE_BVH_QUANTIZED
+	quantize_bounds(node.origin.x, node.scale.x, lo.x, hi.x, node.q_min_x[slot], node.q_max_x[slot]);
+	quantize_bounds(node.origin.y, node.scale.y, lo.y, hi.y, node.q_min_y[slot], node.q_max_y[slot]);
+	quantize_bounds(node.origin.z, node.scale.z, lo.z, hi.z, node.q_min_z[slot], node.q_max_z[slot]);
+#else
+	node.bounds.min_x[slot] = lo.x;
+	node.bounds.min_y[slot] = lo.y;
+	node.bounds.min_z[slot] = lo.z;
+	node.bounds.max_x[slot] = hi.x;
+	node.bounds.max_y[slot] = hi.y;
+	node.bounds.max_z[slot] = hi.z;
+#endif
+}
+
+float bvh_node_area(const bvh_node& node)
+{
+	aabb box;
+	box.min = node.bounds_min;
+	box.max = node.bounds_max;
+	return box.area();
+}
+
+// Turns the binary subtree under binary_index into one wide node by opening
+// the largest interior child until WIDE_BVH_WIDTH slots are used
+int collapse_bvh_node(const bvh& binary, int binary_index, wide_bvh& wide)
+{
+	int slots[WIDE_BVH_WIDTH];
+	int slot_count = 0;
+
+	const bvh_node& root = binary.nodes[binary_index];
+	if (root.count > 0)
+	{
+		slots[slot_count++] = binary_index;
+	}
+	else
+	{
+		slots[slot_count++] = root.first;
+		slots[slot_count++] = root.first + 1;
+	}
+
+	while (slot_count < WIDE_BVH_WIDTH)
+	{
+		int open = -1;
+		float open_area = -1;
+		for (int i = 0; i < slot_count; i++)
+		{
+			const bvh_node& n = binary.nodes[slots[i]];
+			if (n.count == 0 && bvh_node_area(n) > open_area)
+			{
+				open = i;
+				open_area = bvh_node_area(n);
+			}
+		}
+
+		if (open < 0)
+			break;
+
+		int opened = slots[open];
+		slots[open] = binary.nodes[opened].first;
+		slots[slot_count++] = binary.nodes[opened].first + 1;
+	}
+
+	int wide_index = (int) wide.nodes.size();
+	wide.nodes.emplace_back();
+
+	wide_bvh_node node = {};
+	node.child_count = slot_count;
+
+#if WIDE_BVH_QUANTIZED
+	glm::vec3 lo = root.bounds_min;
+	glm::vec3 hi = root.bounds_max;
+	node.origin = lo;
+	node.scale = glm::max((hi - lo) / 255.0f * 1.0001f, glm::vec3(std::numeric_limits<float>::min()));
+#endif
+
+	for (int i = 0; i < slot_count; i++)
+	{
+		const bvh_node& n = binary.nodes[slots[i]];
+		wide_bvh_set_child_bounds(node, i, n.bounds_min, n.bounds_max);
+
+		if (n.count > 0)
+		{
+			node.child[i] = n.first;
+			node.count[i] = n.count;
+			wide.leaf_count++;
+		}
+		else
+		{
+			node.child[i] = collapse_bvh_node(binary, slots[i], wide);
+			node.count[i] = 0;
+		}
+	}
+
+	wide.nodes[wide_index] = node;
+	return wide_index;
+}
+
+void build_wide_bvh(wide_bvh& wide, const bvh& binary)
+{
+	auto begin = std::chrono::steady_clock::now();
+
+	wide = wide_bvh();
+	if (binary.empty())
+		return;
+
+	wide.sphere_count = binary.sphere_count;
+	wide.indices = binary.indices;
+	wide.nodes.reserve(binary.node_count / 2 + 1);
+	collapse_bvh_node(binary, 0, wide);
+	wide.node_count = (int) wide.nodes.size();
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+	wide.build_ms = elapsed.count();
+}
+
+// Ray data broadcast for the child box test
+struct wide_bvh_ray
+{
+	simd_float ox, oy, oz;
+	simd_float inv_x, inv_y, inv_z;
+	simd_float t_min;
+
+	wide_bvh_ray(const ray& r)
+	{
+		ox = simd_set1(r.origin.x);
+		oy = simd_set1(r.origin.y);
+		oz = simd_set1(r.origin.z);
+		inv_x = simd_set1(1.0f / r.direction.x);
+		inv_y = simd_set1(1.0f / r.direction.y);
+		inv_z = simd_set1(1.0f / r.direction.z);
+		t_min = simd_set1(r.t_min);
+	}
+};
+
+// Slab test of every child box of node. Writes each child's entry distance
+// (+inf for a miss, for an unused slot, or when it starts past t_far) and
+// returns the bitmask of children hit.
+int wide_bvh_test_children(const wide_bvh_node& node, const wide_bvh_ray& r, float t_far, float* t_enter)
+{
+#if WIDE_BVH_QUANTIZED
+	wide_bvh_bounds bounds;
+	wide_bvh_dequantize(node, bounds);
+#else
+	const wide_bvh_bounds& bounds = node.bounds;
+#endif
+
+	simd_float inf = simd_set1(std::numeric_limits<float>::infinity());
+	simd_float limit = simd_set1(t_far * 1.0000008f);
+	int mask = 0;
+
+	for (int c = 0; c < WIDE_BVH_WIDTH; c += SIMD_WIDTH)
+	{
+		simd_float tx0 = simd_mul(simd_sub(simd_load(&bounds.min_x[c]), r.ox), r.inv_x);
+		simd_float tx1 = simd_mul(simd_sub(simd_load(&bounds.max_x[c]), r.ox), r.inv_x);
+		simd_float ty0 = simd_mul(simd_sub(simd_load(&bounds.min_y[c]), r.oy), r.inv_y);
+		simd_float ty1 = simd_mul(simd_sub(simd_load(&bounds.max_y[c]), r.oy), r.inv_y);
+		simd_float tz0 = simd_mul(simd_sub(simd_load(&bounds.min_z[c]), r.oz), r.inv_z);
+		simd_float tz1 = simd_mul(simd_sub(simd_load(&bounds.max_z[c]), r.oz), r.inv_z);
+
+		simd_float enter = simd_max(simd_max(simd_min(tx0, tx1), simd_min(ty0, ty1)), simd_max(simd_min(tz0, tz1), r.t_min));
+		// Exit padded by a few ulps so rounding never culls a sphere the quadratic hits
+		simd_float exit = simd_min(simd_min(simd_max(tx0, tx1), simd_max(ty0, ty1)), simd_max(tz0, tz1));
+		exit = simd_min(simd_mul(exit, simd_set1(1.0000008f)), limit);
+
+		simd_mask used = simd_lt(simd_lane_index(), simd_set1((float) (node.child_count - c)));
+		simd_mask hit = simd_and(used, simd_le(enter, exit));
+
+		simd_store(&t_enter[c], simd_select(hit, inf, enter));
+		mask |= simd_movemask(hit) << c;
+	}
+
+	return mask;
+}